@@ -1,6 +1,6 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
@@ -17,42 +17,146 @@
 // * B_VALID: the buffer data has been read from the disk.
 // * B_DIRTY: the buffer data has been modified
 //     and needs to be written to disk.
+//
+// File data need not go through the log: bdirty() marks it
+// B_WB, and bsync() or the bflush thread writes it back later.
 
 #include "types.h"
 #include "defs.h"
 #include "param.h"
+#include "mmu.h"
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
 
-struct {
+// Buffers are found through a hash table on (dev, blockno).
+// Each bucket has its own lock, so lookups of different
+// blocks rarely contend, and no lock covers the whole cache.
+// The cache is sized at boot to 1/BCACHEFRAC of the memory
+// free then, with buffers and their data from kalloc().
+#define NBUCKET 1031
+#define HASH(dev, blockno) (((dev) + (blockno)) % NBUCKET)
+#define NWB 32            // buffers written back together
+
+struct bucket {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  struct buf *head;     // buffers hashed here, through next
+  uint nhit;            // lookups that found their block here
+  uint nmiss;
+};
 
-  // Linked list of all buffers, through prev/next.
-  // head.next is most recently used.
-  struct buf head;
+struct {
+  uint nbuf;
+  uint hand;            // clock hand; see bvictim()
+  uint nasync;          // readaheads in progress
+  uint nwb;             // buffers marked B_WB
+  struct buf *buf[NBUFMAX];
+  struct bucket bucket[NBUCKET];
 } bcache;
 
+// Put b in bucket k.  Caller holds its lock.
+static void
+link(struct buf *b, int k)
+{
+  b->next = bcache.bucket[k].head;
+  bcache.bucket[k].head = b;
+  b->bucket = k;
+}
+
+// Take b out of its bucket.  Caller holds its lock.
+static void
+unlink(struct buf *b)
+{
+  struct buf **pp;
+
+  for(pp = &bcache.bucket[b->bucket].head; *pp != b; pp = &(*pp)->next)
+    ;
+  *pp = b->next;
+  b->bucket = -1;
+}
+
+// Must come after kinit2(), so as to see all of memory.
 void
 binit(void)
 {
-  struct buf *b;
+  struct bucket *bk;
+  struct buf *b, *hdr;
+  uint nfree, nused, nsteal, n, i;
+  char *data;
 
-  initlock(&bcache.lock, "bcache");
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++)
+    initlock(&bk->lock, "bcache.bucket");
 
 //PAGEBREAK!
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
+  kmemstat(&nfree, &nused, &nsteal);
+  n = nfree / BCACHEFRAC * (PGSIZE/BSIZE);
+  if(n < NBUF)
+    n = NBUF;
+  if(n > NBUFMAX)
+    n = NBUFMAX;
+  hdr = 0;
+  data = 0;
+  for(i = 0; i < n; i++){
+    if(i % (PGSIZE/sizeof(*b)) == 0 && (hdr = (struct buf*)kalloc()) == 0)
+      break;
+    if(i % (PGSIZE/BSIZE) == 0 && (data = kalloc()) == 0)
+      break;
+    b = &hdr[i % (PGSIZE/sizeof(*b))];
+    memset(b, 0, sizeof(*b));
+    b->dev = b->blockno = -1;
+    b->data = (uchar*)data + (i % (PGSIZE/BSIZE))*BSIZE;
     initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    link(b, HASH(b->dev, b->blockno));
+    bcache.buf[i] = b;
   }
+  if(i < NBUF)
+    panic("binit");
+  bcache.nbuf = i;
+}
+
+// Take a buffer that nobody is using out of its bucket,
+// choosing it with a two-level CLOCK in the spirit of 2Q.
+// A block that has been read in once is cold, and the hand
+// takes it the first time it comes by, unless the block
+// has been used again since; such blocks become hot and
+// survive another pass.  So reading through a large file
+// does not push out blocks that are used all the time.
+// The hand moves atomically and each buffer is looked at
+// under its own bucket's lock, so misses don't serialize.
+// Buffers that log.c has modified but not yet installed are
+// pinned with bpin(), so their refcnt keeps them.
+static struct buf*
+bvictim(void)
+{
+  struct bucket *bk;
+  struct buf *b;
+  uint i;
+  int k;
+
+  for(i = 0; i < 3*bcache.nbuf; i++){
+    b = bcache.buf[__sync_fetch_and_add(&bcache.hand, 1) % bcache.nbuf];
+    if((k = b->bucket) < 0)
+      continue;  // another bget() is moving it
+    bk = &bcache.bucket[k];
+    acquire(&bk->lock);
+    if(b->bucket != k || b->refcnt > 0 || (b->flags & (B_DIRTY|B_WB))){
+      release(&bk->lock);
+      continue;
+    }
+    if(b->ref){
+      b->ref = 0;
+      b->hot = 1;
+    } else if(b->hot)
+      b->hot = 0;
+    else {
+      unlink(b);
+      release(&bk->lock);
+      return b;
+    }
+    release(&bk->lock);
+  }
+  panic("bget: no buffers");
 }
 
 // Look through buffer cache for block on device dev.
@@ -61,35 +165,50 @@ binit(void)
 static struct buf*
 bget(uint dev, uint blockno)
 {
-  struct buf *b;
+  struct bucket *bk;
+  struct buf *b, *nb;
+  int k;
 
-  acquire(&bcache.lock);
+  k = HASH(dev, blockno);
+  bk = &bcache.bucket[k];
+  acquire(&bk->lock);
 
   // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
+  for(b = bk->head; b; b = b->next){
     if(b->dev == dev && b->blockno == blockno){
       b->refcnt++;
-      release(&bcache.lock);
+      b->ref = 1;
+      bk->nhit++;
+      release(&bk->lock);
       acquiresleep(&b->lock);
       return b;
     }
   }
+  bk->nmiss++;
+  release(&bk->lock);
 
   // Not cached; recycle an unused buffer.
-  // Even if refcnt==0, B_DIRTY indicates a buffer is in use
-  // because log.c has modified it but not yet committed it.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0 && (b->flags & B_DIRTY) == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->flags = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
-    }
-  }
-  panic("bget: no buffers");
+  nb = bvictim();
+
+  // Another process may have cached the block meanwhile;
+  // if so, keep nb in this bucket as an empty spare.
+  acquire(&bk->lock);
+  for(b = bk->head; b; b = b->next)
+    if(b->dev == dev && b->blockno == blockno)
+      break;
+  if(b == 0){
+    b = nb;
+    b->dev = dev;
+    b->blockno = blockno;
+  } else
+    nb->dev = nb->blockno = -1;
+  nb->flags = 0;
+  nb->ref = nb->hot = nb->nlog = 0;
+  link(nb, k);
+  b->refcnt++;
+  release(&bk->lock);
+  acquiresleep(&b->lock);
+  return b;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -105,6 +224,65 @@ bread(uint dev, uint blockno)
   return b;
 }
 
+// Start reading a block into the cache, unless it is there
+// already, without waiting for the disk; ideintr() releases
+// the buffer when the data arrives.  Skipped if a quarter of
+// the cache is already being read ahead.
+void
+breadahead(uint dev, uint blockno)
+{
+  struct bucket *bk;
+  struct buf *b;
+
+  if(bcache.nasync >= bcache.nbuf/4)
+    return;
+  bk = &bcache.bucket[HASH(dev, blockno)];
+  acquire(&bk->lock);
+  for(b = bk->head; b; b = b->next)
+    if(b->dev == dev && b->blockno == blockno)
+      break;
+  release(&bk->lock);
+  if(b)
+    return;
+
+  b = bget(dev, blockno);
+  if(b->flags & B_VALID){
+    brelse(b);
+    return;
+  }
+  __sync_fetch_and_add(&bcache.nasync, 1);
+  b->flags |= B_ASYNC;
+  iderw(b);
+}
+
+// Finish a read started by breadahead().
+// Called from ideintr(), not by b's owner.
+void
+bdone(struct buf *b)
+{
+  struct bucket *bk;
+
+  b->flags &= ~B_ASYNC;
+  __sync_fetch_and_sub(&bcache.nasync, 1);
+  releasesleep(&b->lock);
+  bk = &bcache.bucket[b->bucket];
+  acquire(&bk->lock);
+  b->refcnt--;
+  release(&bk->lock);
+}
+
+// Return a locked buf for a block that the caller is about
+// to overwrite entirely, without reading it from disk.
+struct buf*
+bfresh(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bget(dev, blockno);
+  b->flags |= B_VALID;
+  return b;
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
@@ -115,30 +293,236 @@ bwrite(struct buf *b)
   iderw(b);
 }
 
+// Write n locked buffers to disk, letting the disk
+// driver order them and merge adjacent blocks.
+void
+bwritev(struct buf **b, int n)
+{
+  int i;
+
+  for(i = 0; i < n; i++){
+    if(!holdingsleep(&b[i]->lock))
+      panic("bwritev");
+    b[i]->flags |= B_DIRTY;
+  }
+  iderwv(b, n);
+}
+
+// Mark b, which the caller holds locked and has modified,
+// to be written back to disk later.  Too many such buffers
+// would crowd the cache, so past a limit b is written now.
+void
+bdirty(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bdirty");
+  if(b->flags & B_WB)
+    return;
+  if(bcache.nwb >= bcache.nbuf/4){
+    bwrite(b);
+    return;
+  }
+  b->flags |= B_WB;
+  __sync_fetch_and_add(&bcache.nwb, 1);
+}
+
+// Forget that the locked buffer b needs writing back,
+// as when the log takes it over.
+void
+bclean(struct buf *b)
+{
+  if(b->flags & B_WB){
+    b->flags &= ~B_WB;
+    __sync_fetch_and_sub(&bcache.nwb, 1);
+  }
+}
+
 // Release a locked buffer.
-// Move to the head of the MRU list.
 void
 brelse(struct buf *b)
 {
+  struct bucket *bk;
+
   if(!holdingsleep(&b->lock))
     panic("brelse");
 
   releasesleep(&b->lock);
 
-  acquire(&bcache.lock);
+  // b->bucket cannot change while refcnt > 0.
+  bk = &bcache.bucket[b->bucket];
+  acquire(&bk->lock);
   b->refcnt--;
-  if (b->refcnt == 0) {
-    // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
-  }
-  
-  release(&bcache.lock);
+  release(&bk->lock);
 }
+
+// Keep b in the cache even when nobody holds it.  Caller
+// holds b locked, or has it pinned already.
+void
+bpin(struct buf *b)
+{
+  struct bucket *bk = &bcache.bucket[b->bucket];
+
+  acquire(&bk->lock);
+  b->refcnt++;
+  release(&bk->lock);
+}
+
+void
+bunpin(struct buf *b)
+{
+  struct bucket *bk = &bcache.bucket[b->bucket];
+
+  acquire(&bk->lock);
+  b->refcnt--;
+  release(&bk->lock);
+}
+
 //PAGEBREAK!
-// Blank page.
+// Write back buffers v[0..n-1], which the caller holds locked
+// and marked B_WB, and release them.
+static void
+bwbv(struct buf **v, int n)
+{
+  int i;
+
+  if(n == 0)
+    return;
+  for(i = 0; i < n; i++){
+    bclean(v[i]);
+    v[i]->flags |= B_DIRTY;
+  }
+  iderwv(v, n);
+  for(i = 0; i < n; i++)
+    brelse(v[i]);
+}
+
+// Add b, which the caller holds a reference to, to the
+// batch v[0..n-1] of buffers to write back, writing the
+// batch once it is full.  Returns the new size of v.
+// So as not to deadlock with processes locking several
+// buffers, b is only waited for when v is empty.
+static int
+bwbadd(struct buf **v, int n, struct buf *b)
+{
+  if(n == 0 || !tryacquiresleep(&b->lock)){
+    bwbv(v, n);
+    n = 0;
+    acquiresleep(&b->lock);
+  }
+  if(!(b->flags & B_WB)){
+    brelse(b);
+    return n;
+  }
+  v[n++] = b;
+  if(n == NWB){
+    bwbv(v, n);
+    n = 0;
+  }
+  return n;
+}
 
+// Take a reference to b if it is marked B_WB.
+static int
+bwbhold(struct buf *b)
+{
+  struct bucket *bk;
+  int k;
+
+  if((k = b->bucket) < 0 || !(b->flags & B_WB))
+    return 0;
+  bk = &bcache.bucket[k];
+  acquire(&bk->lock);
+  if(b->bucket != k){
+    release(&bk->lock);
+    return 0;
+  }
+  b->refcnt++;
+  release(&bk->lock);
+  return 1;
+}
+
+// Write back all the buffers marked B_WB.
+void
+bsync(void)
+{
+  struct buf *v[NWB];
+  uint i;
+  int n;
+
+  n = 0;
+  for(i = 0; i < bcache.nbuf; i++)
+    if(bwbhold(bcache.buf[i]))
+      n = bwbadd(v, n, bcache.buf[i]);
+  bwbv(v, n);
+}
+
+// Write back whichever of the nb blocks of dev listed in
+// blockno are cached and marked B_WB.  Zeros are ignored.
+void
+bsyncv(uint dev, uint *blockno, int nb)
+{
+  struct buf *v[NWB], *b;
+  struct bucket *bk;
+  int i, n;
+
+  n = 0;
+  for(i = 0; i < nb; i++){
+    if(blockno[i] == 0)
+      continue;
+    bk = &bcache.bucket[HASH(dev, blockno[i])];
+    acquire(&bk->lock);
+    for(b = bk->head; b; b = b->next)
+      if(b->dev == dev && b->blockno == blockno[i])
+        break;
+    if(b && (b->flags & B_WB))
+      b->refcnt++;
+    else
+      b = 0;
+    release(&bk->lock);
+    if(b)
+      n = bwbadd(v, n, b);
+  }
+  bwbv(v, n);
+}
+
+// Write back file data every FLUSHTICKS ticks.
+static void
+bflush(void)
+{
+  uint t0;
+
+  for(;;){
+    acquire(&tickslock);
+    t0 = ticks;
+    while(ticks - t0 < FLUSHTICKS)
+      sleep(&ticks, &tickslock);
+    release(&tickslock);
+    bsync();
+  }
+}
+
+// Start the bflush thread.  Called from forkret().
+void
+bflushinit(void)
+{
+  kthread("bflush", bflush);
+}
+
+// Report the number of buffers, how many lookups found
+// their block cached or not, and how many buffers wait to
+// be written back.
+void
+bstat(uint *nbuf, uint *nhit, uint *nmiss, uint *nwb)
+{
+  struct bucket *bk;
+
+  *nbuf = bcache.nbuf;
+  *nwb = bcache.nwb;
+  *nhit = *nmiss = 0;
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++){
+    *nhit += bk->nhit;
+    *nmiss += bk->nmiss;
+  }
+}
+//PAGEBREAK!
+// Blank page.
@@ -4,11 +4,15 @@ struct buf {
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
-  struct buf *next;
+  int bucket;        // hash bucket holding it, or -1 while being moved
+  uchar ref;         // used since the clock hand last came by
+  uchar hot;         // used more than once; see bvictim()
+  uchar nlog;        // transactions holding it; see log_write()
+  struct buf *next;  // hash bucket list
   struct buf *qnext; // disk queue
-  uchar data[BSIZE];
+  uchar *data;       // BSIZE bytes
 };
 #define B_VALID 0x2  // buffer has been read from disk
 #define B_DIRTY 0x4  // buffer needs to be written to disk
-
+#define B_ASYNC 0x8  // readahead; nobody waits for the disk
+#define B_WB    0x10 // file data to be written back; see bdirty()
@@ -235,10 +235,15 @@ consoleintr(int (*getc)(void))
 int
 consoleread(struct inode *ip, char *dst, int n)
 {
+  char buf[INPUT_BUF];
   uint target;
   int c;
 
   iunlock(ip);
+  // Collect the input in buf and copy it out after releasing
+  // cons.lock, since touching dst may read it back from swap.
+  if(n > INPUT_BUF)
+    n = INPUT_BUF;
   target = n;
   acquire(&cons.lock);
   while(n > 0){
@@ -259,12 +264,13 @@ consoleread(struct inode *ip, char *dst, int n)
       }
       break;
     }
-    *dst++ = c;
+    buf[target - n] = c;
     --n;
     if(c == '\n')
       break;
   }
   release(&cons.lock);
+  memmove(dst, buf, target - n);
   ilock(ip);
 
   return target - n;
@@ -273,13 +279,19 @@ consoleread(struct inode *ip, char *dst, int n)
 int
 consolewrite(struct inode *ip, char *buf, int n)
 {
-  int i;
+  char kbuf[128];
+  int i, j, m;
 
   iunlock(ip);
-  acquire(&cons.lock);
-  for(i = 0; i < n; i++)
-    consputc(buf[i] & 0xff);
-  release(&cons.lock);
+  for(i = 0; i < n; i += m){
+    // Copy out of user memory before taking cons.lock.
+    m = n - i < sizeof(kbuf) ? n - i : sizeof(kbuf);
+    memmove(kbuf, buf + i, m);
+    acquire(&cons.lock);
+    for(j = 0; j < m; j++)
+      consputc(kbuf[j] & 0xff);
+    release(&cons.lock);
+  }
   ilock(ip);
 
   return n;
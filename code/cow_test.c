@@ -0,0 +1,54 @@
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+
+#define NPAGE 16
+
+static char buf[NPAGE*4096];
+
+// fork() shares pages copy-on-write; each side must
+// still see only its own writes, including writes the
+// kernel makes on its behalf (read() into a shared page).
+int
+main(int argc, char *argv[])
+{
+  int i, pid, fds[2];
+
+  for(i = 0; i < NPAGE; i++)
+    buf[i*4096] = 'p';
+  if(pipe(fds) < 0){
+    printf(1, "cow_test: pipe failed\n");
+    exit();
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf(1, "cow_test: fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    for(i = 0; i < NPAGE; i += 2)
+      buf[i*4096] = 'c';
+    for(i = 0; i < NPAGE; i++)
+      if(buf[i*4096] != (i%2 ? 'p' : 'c')){
+        printf(1, "cow_test: child sees parent's page %d\n", i);
+        exit();
+      }
+    write(fds[1], "k", 1);
+    exit();
+  }
+
+  // The pipe read lands in a page still shared with the child.
+  if(read(fds[0], &buf[1], 1) != 1 || buf[1] != 'k'){
+    printf(1, "cow_test: read into shared page FAILED\n");
+    exit();
+  }
+  wait();
+  for(i = 0; i < NPAGE; i++)
+    if(buf[i*4096] != 'p'){
+      printf(1, "cow_test: FAILED, parent page %d changed\n", i);
+      exit();
+    }
+  printf(1, "cow_test: ok\n");
+  exit();
+}
@@ -7,14 +7,30 @@ struct proc;
 struct rtcdate;
 struct spinlock;
 struct sleeplock;
+struct shmseg;
+struct slabcache;
 struct stat;
 struct superblock;
+struct vma;
+struct vmspace;
 
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
+void            breadahead(uint, uint);
+void            bdone(struct buf*);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            bwritev(struct buf**, int);
+void            bstat(uint*, uint*, uint*, uint*);
+struct buf*     bfresh(uint, uint);
+void            bpin(struct buf*);
+void            bunpin(struct buf*);
+void            bdirty(struct buf*);
+void            bclean(struct buf*);
+void            bsync(void);
+void            bsyncv(uint, uint*, int);
+void            bflushinit(void);
 
 // console.c
 void            consoleinit(void);
@@ -27,19 +43,23 @@ int             exec(char*, char**);
 
 // file.c
 struct file*    filealloc(void);
+void            filecachestat(int*, int*);
 void            fileclose(struct file*);
 struct file*    filedup(struct file*);
 void            fileinit(void);
 int             fileread(struct file*, char*, int n);
 int             filestat(struct file*, struct stat*);
+int             filesync(struct file*);
 int             filewrite(struct file*, char*, int n);
 
 // fs.c
 void            readsb(int dev, struct superblock *sb);
+void            icachestat(int*, int*);
 int             dirlink(struct inode*, char*, uint);
 struct inode*   dirlookup(struct inode*, char*, uint*);
 struct inode*   ialloc(uint, short);
 struct inode*   idup(struct inode*);
+void            icacheinit(void);
 void            iinit(int dev);
 void            ilock(struct inode*);
 void            iput(struct inode*);
@@ -50,6 +70,7 @@ int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, char*, uint, uint);
+void            isync(struct inode*);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, char*, uint, uint);
 
@@ -57,6 +78,7 @@ int             writei(struct inode*, char*, uint, uint);
 void            ideinit(void);
 void            ideintr(void);
 void            iderw(struct buf*);
+void            iderwv(struct buf**, int);
 
 // ioapic.c
 void            ioapicenable(int irq, int cpu);
@@ -66,8 +88,11 @@ void            ioapicinit(void);
 // kalloc.c
 char*           kalloc(void);
 void            kfree(char*);
+void            kdup(char*);
+int             krefcnt(char*);
 void            kinit1(void*, void*);
 void            kinit2(void*, void*);
+void            kmemstat(uint*, uint*, uint*);
 
 // kbd.c
 void            kbdintr(void);
@@ -86,16 +111,27 @@ void            initlog(int dev);
 void            log_write(struct buf*);
 void            begin_op();
 void            end_op();
+void            begin_opn(int);
+void            end_opn(int);
+int             log_opmax(void);
+void            log_sync(void);
 
 // mp.c
 extern int      ismp;
 void            mpinit(void);
 
+// pci.c
+int             pcifind(int, int, uint*);
+uint            pciread(uint, int);
+void            pciwrite(uint, int, uint);
+
 // picirq.c
 void            picenable(int);
 void            picinit(void);
 
 // pipe.c
+void            pipeinit(void);
+void            pipecachestat(int*, int*);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, char*, int);
@@ -108,6 +144,7 @@ void            exit(void);
 int             fork(void);
 int             growproc(int);
 int             kill(int);
+void            kthread(char*, void (*)(void));
 struct cpu*     mycpu(void);
 struct proc*    myproc();
 int             getptable(void*, int);
@@ -129,6 +166,8 @@ int             sem_wait(int, int);
 int             sem_signal(int, int);
 int             clone(void (*func) (void*), void *arg, void *stack);
 int             join(void **stack);
+int             join_tid(int tid, void **stack);
+int             detach(int tid);
 int 		wait2(int *,int *,int *);
 static struct proc*    (*ready_process)(void);
 int             getscheduler();
@@ -138,6 +177,20 @@ void            yield(void);
 // swtch.S
 void            swtch(struct context**, struct context*);
 
+// shm.c
+void            shminit(void);
+int             shmget(int, int);
+int             shmat(int);
+int             shmrm(int);
+void            shmdup(struct shmseg*);
+void            shmput(struct shmseg*);
+
+// slab.c
+void            slabinit(struct slabcache*, char*, uint);
+void*           slaballoc(struct slabcache*);
+void            slabfree(struct slabcache*, void*);
+void            slabstat(struct slabcache*, int*, int*);
+
 // spinlock.c
 void            acquire(struct spinlock*);
 void            getcallerpcs(void*, uint*);
@@ -149,6 +202,7 @@ void            popcli(void);
 
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
+int             tryacquiresleep(struct sleeplock*);
 void            releasesleep(struct sleeplock*);
 int             holdingsleep(struct sleeplock*);
 void            initsleeplock(struct sleeplock*, char*);
@@ -162,9 +216,19 @@ int             strlen(const char*);
 int             strncmp(const char*, const char*, uint);
 char*           strncpy(char*, const char*, int);
 
+// swap.c
+void            swapinit(int);
+int             swapalloc(void);
+void            swapdup(uint);
+void            swapfree(uint);
+void            swapread(uint, char*);
+void            swapwrite(uint, char*);
+void            swapstat(uint*, uint*);
+
 // syscall.c
 int             argint(int, int*);
 int             argptr(int, char**, int);
+int             argrdptr(int, char**, int);
 int             argstr(int, char**);
 int             fetchint(uint, int*);
 int             fetchstr(uint, char**);
@@ -191,14 +255,36 @@ pde_t*          setupkvm(void);
 char*           uva2ka(pde_t*, char*);
 int             allocuvm(pde_t*, uint, uint);
 int             deallocuvm(pde_t*, uint, uint);
+void            vmfree(struct vmspace*, uint, uint);
 void            freevm(pde_t*);
 void            inituvm(pde_t*, char*, uint);
-int             loaduvm(pde_t*, char*, struct inode*, uint, uint);
-pde_t*          copyuvm(pde_t*, uint);
+pde_t*          copyuvm(pde_t*, uint, int);
+int             cowfault(pde_t*, uint);
+int             pagefault(uint, int);
+int             uvmprefault(uint, uint, int);
+void            uvmpin(void);
+void            uvmunpin(void);
+uint            uvmlimit(uint);
+int             pagewait(uint);
+struct vma*     vmaadd(struct vmspace*, uint, uint, struct inode*, uint, uint, int);
+int             vmacopy(struct vmspace*, struct vmspace*, int);
+uint            vmamap(struct inode*, uint, uint, uint, int, int);
+int             vmaunmap(uint, uint);
+uint            vmamappages(char**, int, int, struct shmseg*);
+int             vmadetach(uint);
+int             unshareuvm(struct vmspace*);
 void            switchuvm(struct proc*);
 void            switchkvm(void);
 int             copyout(pde_t*, uint, void*, uint);
 void            clearpteu(pde_t *pgdir, char *uva);
+void            vmsinit(void);
+struct vmspace* vmsalloc(pde_t*, uint);
+struct vmspace* vmsdup(struct vmspace*);
+void            vmsexit(struct vmspace*);
+void            vmsput(struct vmspace*);
+void            swapreserve(int);
+void            vmsusage(struct vmspace*, int*, int*);
+int             vmsptpages(void);
 
 // number of elements in fixed-size array
 #define NELEM(x) (sizeof(x)/sizeof((x)[0]))
@@ -6,6 +6,8 @@
 #include "defs.h"
 #include "x86.h"
 #include "elf.h"
+#include "spinlock.h"
+#include "vmspace.h"
 
 int
 exec(char *path, char **argv)
@@ -16,7 +18,8 @@ exec(char *path, char **argv)
   struct elfhdr elf;
   struct inode *ip;
   struct proghdr ph;
-  pde_t *pgdir, *oldpgdir;
+  pde_t *pgdir;
+  struct vmspace *vm, *oldvm;
   struct proc *curproc = myproc();
 
   begin_op();
@@ -28,6 +31,7 @@ exec(char *path, char **argv)
   }
   ilock(ip);
   pgdir = 0;
+  vm = 0;
 
   // Check ELF header
   if(readi(ip, (char*)&elf, 0, sizeof(elf)) != sizeof(elf))
@@ -37,8 +41,11 @@ exec(char *path, char **argv)
 
   if((pgdir = setupkvm()) == 0)
     goto bad;
+  if((vm = vmsalloc(pgdir, 0)) == 0)
+    goto bad;
 
-  // Load program into memory.
+  // Map the program.  Its pages are read in from ip
+  // when first touched; see pagefault().
   sz = 0;
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
     if(readi(ip, (char*)&ph, off, sizeof(ph)) != sizeof(ph))
@@ -49,12 +56,15 @@ exec(char *path, char **argv)
       goto bad;
     if(ph.vaddr + ph.memsz < ph.vaddr)
       goto bad;
-    if((sz = allocuvm(pgdir, sz, ph.vaddr + ph.memsz)) == 0)
+    if(ph.vaddr + ph.memsz > MMAPBASE)
       goto bad;
     if(ph.vaddr % PGSIZE != 0)
       goto bad;
-    if(loaduvm(pgdir, (char*)ph.vaddr, ip, ph.off, ph.filesz) < 0)
+    if(vmaadd(vm, ph.vaddr, PGROUNDUP(ph.vaddr + ph.memsz), ip, ph.off, ph.filesz,
+              PTE_W|PTE_U) == 0)
       goto bad;
+    if(ph.vaddr + ph.memsz > sz)
+      sz = ph.vaddr + ph.memsz;
   }
   iunlockput(ip);
   end_op();
@@ -93,22 +103,29 @@ exec(char *path, char **argv)
       last = s+1;
   safestrcpy(curproc->name, last, sizeof(curproc->name));
 
-  // Commit to the user image.
-  oldpgdir = curproc->pgdir;
-  curproc->pgdir = pgdir;
-  curproc->sz = sz;
+  // Commit to the user image.  Any threads sharing the
+  // old address space keep it; we get a private one.
+  vm->sz = sz;
+  oldvm = curproc->vm;
+  curproc->vm = vm;
+  curproc->isthread = 0;
   curproc->tf->eip = elf.entry;  // main
   curproc->tf->esp = sp;
   switchuvm(curproc);
-  freevm(oldpgdir);
+  uvmunpin();
+  vmsexit(oldvm);
+  vmsput(oldvm);
   return 0;
 
  bad:
-  if(pgdir)
-    freevm(pgdir);
   if(ip){
     iunlockput(ip);
     end_op();
   }
+  if(vm){
+    vmsexit(vm);
+    vmsput(vm);
+  } else if(pgdir)
+    freevm(pgdir);
   return -1;
 }
@@ -9,17 +9,29 @@
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "file.h"
+#include "slab.h"
 
 struct devsw devsw[NDEV];
+
+// Open files come from a slab cache, so there is no
+// fixed limit on them; ftable.lock protects their ref counts.
 struct {
   struct spinlock lock;
-  struct file file[NFILE];
+  struct slabcache cache;
 } ftable;
 
 void
 fileinit(void)
 {
   initlock(&ftable.lock, "ftable");
+  slabinit(&ftable.cache, "file", sizeof(struct file));
+}
+
+// Report the number of open files and the pages holding them.
+void
+filecachestat(int *nfile, int *npages)
+{
+  slabstat(&ftable.cache, nfile, npages);
 }
 
 // Allocate a file structure.
@@ -28,16 +40,11 @@ filealloc(void)
 {
   struct file *f;
 
-  acquire(&ftable.lock);
-  for(f = ftable.file; f < ftable.file + NFILE; f++){
-    if(f->ref == 0){
-      f->ref = 1;
-      release(&ftable.lock);
-      return f;
-    }
-  }
-  release(&ftable.lock);
-  return 0;
+  if((f = slaballoc(&ftable.cache)) == 0)
+    return 0;
+  memset(f, 0, sizeof(*f));
+  f->ref = 1;
+  return f;
 }
 
 // Increment ref count for file f.
@@ -69,6 +76,7 @@ fileclose(struct file *f)
   f->ref = 0;
   f->type = FD_NONE;
   release(&ftable.lock);
+  slabfree(&ftable.cache, f);
 
   if(ff.type == FD_PIPE)
     pipeclose(ff.pipe, ff.writable);
@@ -92,6 +100,19 @@ filestat(struct file *f, struct stat *st)
   return -1;
 }
 
+// Write f's data and everything logged so far to disk.
+int
+filesync(struct file *f)
+{
+  if(f->type != FD_INODE)
+    return -1;
+  ilock(f->ip);
+  isync(f->ip);
+  iunlock(f->ip);
+  log_sync();
+  return 0;
+}
+
 // Read from file f.
 int
 fileread(struct file *f, char *addr, int n)
@@ -124,25 +145,29 @@ filewrite(struct file *f, char *addr, int n)
   if(f->type == FD_PIPE)
     return pipewrite(f->pipe, addr, n);
   if(f->type == FD_INODE){
-    // write a few blocks at a time to avoid exceeding
-    // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
-    // and 2 blocks of slop for non-aligned writes.
+    // write as many blocks at a time as one transaction
+    // can hold, reserving log space for them, including
+    // i-node, indirect blocks (one per NINDIRECT data
+    // blocks, plus 2 for the ends and 1 double-indirect),
+    // allocation blocks, and 2 blocks of slop for
+    // non-aligned writes.
     // this really belongs lower down, since writei()
     // might be writing a device like the console.
-    int max = ((LOGSIZE-1-1-2) / 2) * 512;
+    int max = ((log_opmax()-6) * NINDIRECT / (2*NINDIRECT+1)) * BSIZE;
     int i = 0;
     while(i < n){
       int n1 = n - i;
       if(n1 > max)
         n1 = max;
+      int nb = (n1 + BSIZE-1) / BSIZE;
+      int nlog = 2*nb + nb/NINDIRECT + 1+3+2;
 
-      begin_op();
+      begin_opn(nlog);
       ilock(f->ip);
       if ((r = writei(f->ip, addr + i, f->off, n1)) > 0)
         f->off += r;
       iunlock(f->ip);
-      end_op();
+      end_opn(nlog);
 
       if(r < 0)
         break;
@@ -0,0 +1,50 @@
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "fs.h"
+#include "meminfo.h"
+
+// Pages to kilobytes.
+#define KB(n) ((n) * 4)
+
+static void
+report(void)
+{
+  struct meminfo mi;
+
+  if(meminfo(&mi) < 0){
+    printf(2, "free: meminfo failed\n");
+    exit();
+  }
+  printf(1, "\ttotal\tused\tfree\t(KB)\n");
+  printf(1, "mem:\t%d\t%d\t%d\n", KB(mi.npages),
+         KB(mi.npages - mi.nfree), KB(mi.nfree));
+  printf(1, "swap:\t%d\t%d\t%d\n", KB(mi.nswap),
+         KB(mi.nswapused), KB(mi.nswap - mi.nswapused));
+  printf(1, "page tables: %d KB, cache steals: %d pages\n",
+         KB(mi.nptpages), mi.nsteal);
+  printf(1, "pipes: %d (%d KB)  inodes: %d (%d KB)  files: %d (%d KB)\n",
+         mi.npipe, KB(mi.npipepages), mi.ninode, KB(mi.ninodepages),
+         mi.nfile, KB(mi.nfilepages));
+  printf(1, "block cache: %d KB, %d hits, %d misses, %d KB dirty\n",
+         mi.nbuf * BSIZE / 1024, mi.nbhit, mi.nbmiss, mi.nbwb * BSIZE / 1024);
+}
+
+// free [interval [count]]: show memory usage, like
+// vmstat every interval seconds if one is given.
+int
+main(int argc, char *argv[])
+{
+  int interval, count;
+
+  interval = argc > 1 ? atoi(argv[1]) : 0;
+  count = argc > 2 ? atoi(argv[2]) : -1;
+  for(;;){
+    report();
+    if(interval <= 0 || --count == 0)
+      break;
+    sleep(interval * 100);
+    printf(1, "\n");
+  }
+  exit();
+}
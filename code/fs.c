@@ -20,6 +20,7 @@
 #include "fs.h"
 #include "buf.h"
 #include "file.h"
+#include "slab.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 static void itrunc(struct inode*);
@@ -38,39 +39,217 @@ readsb(int dev, struct superblock *sb)
   brelse(bp);
 }
 
-// Zero a block.
+// Zero a block.  It is about to be logged, so there is
+// no need to read it first.
 static void
 bzero(int dev, int bno)
 {
   struct buf *bp;
 
-  bp = bread(dev, bno);
+  bp = bfresh(dev, bno);
   memset(bp->data, 0, BSIZE);
   log_write(bp);
   brelse(bp);
 }
 
 // Blocks.
+//
+// bsum counts the free blocks under each bitmap block, so that
+// balloc() reads only bitmap blocks with room in them.  balloc()
+// looks first at the block after the one it last gave the same
+// inode (ip->goal), so that a file's blocks lie together.  Once
+// an inode has taken a block that way, balloc() also keeps up to
+// NPREALLOC free blocks after it as the inode's window, which
+// other inodes' allocations pass over, so that files written at
+// the same time do not interleave and a growing file finds its
+// next block free at once.  Windows are only in memory; a block
+// is marked in the bitmap when it is handed out, so a crash
+// leaks nothing.
+//
+// If only blocks in other inodes' windows are left, balloc()
+// takes one of those rather than fail.
+//
+// bsum.lock protects bsum; a bitmap block's sleep-lock must be
+// held too to mark blocks in it or to open a window in it.
+
+#define NBSUM  2048   // bitmap blocks counted; those after are scanned
+#define NWIN   16     // windows
+
+struct {
+  struct spinlock lock;
+  uint nbmap;               // bitmap blocks
+  uint rotor;               // where balloc() looks for a new inode
+  ushort nfree[NBSUM];      // free blocks under each bitmap block
+  struct {
+    struct inode *ip;       // owner, or 0
+    uint start, end;        // free blocks [start, end) kept for ip
+  } win[NWIN];
+  int nextwin;              // window to take when none is free
+} bsum;
+
+// Count the free blocks of dev.  Called by iinit(), after
+// initlog() has recovered the bitmap.
+static void
+bsuminit(int dev)
+{
+  struct buf *bp;
+  uint k, bi, n;
+
+  initlock(&bsum.lock, "bsum");
+  bsum.nbmap = (sb.size + BPB - 1) / BPB;
+  for(k = 0; k < bsum.nbmap && k < NBSUM; k++){
+    bp = bread(dev, sb.bmapstart + k);
+    n = 0;
+    for(bi = 0; bi < BPB && k*BPB + bi < sb.size; bi++)
+      if((bp->data[bi/8] & (1 << (bi % 8))) == 0)
+        n++;
+    bsum.nfree[k] = n;
+    brelse(bp);
+  }
+}
+
+// Return the window of ip, or -1.  Caller holds bsum.lock.
+static int
+bwin(struct inode *ip)
+{
+  int w;
+
+  for(w = 0; w < NWIN; w++)
+    if(bsum.win[w].ip == ip)
+      return w;
+  return -1;
+}
+
+// Is block b in a window other than ip's?
+// Caller holds bsum.lock.
+static int
+inwin(uint b, struct inode *ip)
+{
+  int w;
+
+  for(w = 0; w < NWIN; w++)
+    if(bsum.win[w].ip && bsum.win[w].ip != ip &&
+       b >= bsum.win[w].start && b < bsum.win[w].end)
+      return 1;
+  return 0;
+}
+
+// Drop ip's window, if it has one.
+static void
+bwinfree(struct inode *ip)
+{
+  int w;
+
+  acquire(&bsum.lock);
+  if((w = bwin(ip)) >= 0)
+    bsum.win[w].ip = 0;
+  release(&bsum.lock);
+}
+
+// ip has just taken block b from bitmap block bp, number k.
+// Move ip's window past b, or open a new one there.
+// Caller holds bsum.lock.
+static void
+bwinmove(struct inode *ip, uint b, struct buf *bp, uint k)
+{
+  uint e, bi;
+  int w;
+
+  if((w = bwin(ip)) >= 0 && b >= bsum.win[w].start && b < bsum.win[w].end){
+    bsum.win[w].start = b + 1;
+    if(bsum.win[w].start < bsum.win[w].end)
+      return;
+  }
+  if(w < 0){
+    for(w = 0; w < NWIN && bsum.win[w].ip; w++)
+      ;
+    if(w == NWIN){
+      w = bsum.nextwin;
+      bsum.nextwin = (w + 1) % NWIN;
+    }
+  }
+
+  // Free blocks after b, in the same bitmap block.
+  for(e = b + 1; e < b + 1 + NPREALLOC && e < (k+1)*BPB && e < sb.size; e++){
+    bi = e % BPB;
+    if((bp->data[bi/8] & (1 << (bi % 8))) != 0 || inwin(e, ip))
+      break;
+  }
+  bsum.win[w].ip = ip;
+  bsum.win[w].start = b + 1;
+  bsum.win[w].end = e;
+}
+
+// Look in bitmap block bp, number k, for a free block of
+// ip's from bit bi on, and mark it in use.  If any is set,
+// take blocks in other inodes' windows too.  Returns the
+// block, or 0.  Caller holds bsum.lock.
+static uint
+bscan(struct inode *ip, struct buf *bp, uint k, uint bi, int any)
+{
+  uint b;
+  int m;
+
+  for(; bi < BPB && k*BPB + bi < sb.size; bi++){
+    if(bp->data[bi/8] == 0xff && bi % 8 == 0){
+      bi += 7;
+      continue;
+    }
+    b = k*BPB + bi;
+    m = 1 << (bi % 8);
+    if((bp->data[bi/8] & m) == 0 && (any || !inwin(b, ip))){  // Is block free?
+      bp->data[bi/8] |= m;  // Mark block in use.
+      if(k < NBSUM)
+        bsum.nfree[k]--;
+      return b;
+    }
+  }
+  return 0;
+}
 
-// Allocate a zeroed disk block.
+// Allocate a disk block for ip, near the last one it got.
+// The block is not zeroed: an indirect block is zeroed by
+// bmap(), and writei() fills a data block.
 static uint
-balloc(uint dev)
+balloc(struct inode *ip)
 {
-  int b, bi, m;
+  uint goal, k, i, b;
+  int any;
   struct buf *bp;
 
-  bp = 0;
-  for(b = 0; b < sb.size; b += BPB){
-    bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
-      m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
-        bp->data[bi/8] |= m;  // Mark block in use.
-        log_write(bp);
-        brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
-      }
+  acquire(&bsum.lock);
+  goal = ip->goal;
+  if(goal == 0 || goal >= sb.size)
+    goal = bsum.rotor;
+  release(&bsum.lock);
+
+  // Visit the bitmap blocks from the goal's on, coming back
+  // to the goal's at the end for the blocks before the goal.
+  // Then go round again, ready to take others' windows.
+  for(i = 0; i <= 2*bsum.nbmap+1; i++){
+    any = i > bsum.nbmap;
+    k = (goal/BPB + i % (bsum.nbmap+1)) % bsum.nbmap;
+    acquire(&bsum.lock);
+    if(k < NBSUM && bsum.nfree[k] == 0){
+      release(&bsum.lock);
+      continue;
+    }
+    release(&bsum.lock);
+
+    bp = bread(ip->dev, sb.bmapstart + k);
+    acquire(&bsum.lock);
+    b = bscan(ip, bp, k, i == 0 ? goal % BPB : 0, any);
+    if(b != 0){
+      if(ip->goal != 0)  // second block or later: a writer
+        bwinmove(ip, b, bp, k);
+      ip->goal = b + 1;
+      bsum.rotor = b + 1;
+    }
+    release(&bsum.lock);
+    if(b != 0){
+      log_write(bp);
+      brelse(bp);
+      return b;
     }
     brelse(bp);
   }
@@ -84,13 +263,16 @@ bfree(int dev, uint b)
   struct buf *bp;
   int bi, m;
 
-  readsb(dev, &sb);
   bp = bread(dev, BBLOCK(b, sb));
   bi = b % BPB;
   m = 1 << (bi % 8);
   if((bp->data[bi/8] & m) == 0)
     panic("freeing free block");
   bp->data[bi/8] &= ~m;
+  acquire(&bsum.lock);
+  if(b / BPB < NBSUM)
+    bsum.nfree[b / BPB]++;
+  release(&bsum.lock);
   log_write(bp);
   brelse(bp);
 }
@@ -120,12 +302,12 @@ bfree(int dev, uint b)
 //   is non-zero. ialloc() allocates, and iput() frees if
 //   the reference and link counts have fallen to zero.
 //
-// * Referencing in cache: an entry in the inode cache
-//   is free if ip->ref is zero. Otherwise ip->ref tracks
-//   the number of in-memory pointers to the entry (open
-//   files and current directories). iget() finds or
-//   creates a cache entry and increments its ref; iput()
-//   decrements ref.
+// * Referencing in cache: the inode cache holds only
+//   entries with ip->ref > 0; ip->ref tracks the number of
+//   in-memory pointers to the entry (open files and current
+//   directories). iget() finds or creates a cache entry and
+//   increments its ref; iput() decrements ref, and frees the
+//   entry back to the slab cache when ref reaches zero.
 //
 // * Valid: the information (type, size, &c) in an inode
 //   cache entry is only correct when ip->valid is 1.
@@ -155,7 +337,7 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
-// The icache.lock spin-lock protects the allocation of icache
+// The icache.lock spin-lock protects the list of icache
 // entries. Since ip->ref indicates whether an entry is free,
 // and ip->dev and ip->inum indicate which i-node an entry
 // holds, one must hold icache.lock while using any of those fields.
@@ -166,24 +348,39 @@ bfree(int dev, uint b)
 
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct slabcache cache;
+
+  // Linked list of referenced inodes, through prev/next.
+  struct inode head;
 } icache;
 
+// Set up the inode cache.  Runs at boot, before
+// userinit() looks up the first process's cwd.
 void
-iinit(int dev)
+icacheinit(void)
 {
-  int i = 0;
-  
   initlock(&icache.lock, "icache");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&icache.inode[i].lock, "inode");
-  }
+  slabinit(&icache.cache, "inode", sizeof(struct inode));
+  icache.head.prev = &icache.head;
+  icache.head.next = &icache.head;
+}
+
+// Report the number of in-memory inodes and the pages holding them.
+void
+icachestat(int *ninode, int *npages)
+{
+  slabstat(&icache.cache, ninode, npages);
+}
 
+void
+iinit(int dev)
+{
   readsb(dev, &sb);
   cprintf("sb: size %d nblocks %d ninodes %d nlog %d logstart %d\
  inodestart %d bmap start %d\n", sb.size, sb.nblocks,
           sb.ninodes, sb.nlog, sb.logstart, sb.inodestart,
           sb.bmapstart);
+  bsuminit(dev);
 }
 
 static struct inode* iget(uint dev, uint inum);
@@ -242,31 +439,34 @@ iupdate(struct inode *ip)
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct inode *ip;
 
   acquire(&icache.lock);
 
   // Is the inode already cached?
-  empty = 0;
-  for(ip = &icache.inode[0]; ip < &icache.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
+  for(ip = icache.head.next; ip != &icache.head; ip = ip->next){
+    if(ip->dev == dev && ip->inum == inum){
       ip->ref++;
       release(&icache.lock);
       return ip;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
   }
 
-  // Recycle an inode cache entry.
-  if(empty == 0)
+  // Allocate a new inode cache entry.
+  if((ip = slaballoc(&icache.cache)) == 0)
     panic("iget: no inodes");
 
-  ip = empty;
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->seqbn = ip->rabn = 0;
+  ip->goal = 0;
+  initsleeplock(&ip->lock, "inode");
+  ip->next = icache.head.next;
+  ip->prev = &icache.head;
+  icache.head.next->prev = ip;
+  icache.head.next = ip;
   release(&icache.lock);
 
   return ip;
@@ -323,8 +523,8 @@ iunlock(struct inode *ip)
 }
 
 // Drop a reference to an in-memory inode.
-// If that was the last reference, the inode cache entry can
-// be recycled.
+// If that was the last reference, the inode cache entry
+// is freed.
 // If that was the last reference and the inode has no links
 // to it, free the inode (and its content) on disk.
 // All calls to iput() must be inside a transaction in
@@ -348,8 +548,15 @@ iput(struct inode *ip)
   releasesleep(&ip->lock);
 
   acquire(&icache.lock);
-  ip->ref--;
+  if(--ip->ref > 0){
+    release(&icache.lock);
+    return;
+  }
+  ip->next->prev = ip->prev;
+  ip->prev->next = ip->next;
   release(&icache.lock);
+  bwinfree(ip);
+  slabfree(&icache.cache, ip);
 }
 
 // Common idiom: unlock, then put.
@@ -366,19 +573,52 @@ iunlockput(struct inode *ip)
 // The content (data) associated with each inode is stored
 // in blocks on the disk. The first NDIRECT block numbers
 // are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
+// listed in block ip->addrs[NDIRECT].  The NDINDIRECT after
+// those are listed in the indirect blocks that are listed in
+// block ip->addrs[NDIRECT+1].
+
+// Allocate an indirect block for ip.
+static uint
+balloci(struct inode *ip)
+{
+  uint addr;
+
+  addr = balloc(ip);
+  bzero(ip->dev, addr);
+  return addr;
+}
+
+// Return entry i of indirect block addr, allocating a block
+// for it if there is none: an indirect block if ind is set,
+// else a data block.
+static uint
+bmapind(struct inode *ip, uint addr, uint i, int ind)
+{
+  uint *a;
+  struct buf *bp;
+
+  bp = bread(ip->dev, addr);
+  a = (uint*)bp->data;
+  if((addr = a[i]) == 0){
+    a[i] = addr = ind ? balloci(ip) : balloc(ip);
+    log_write(bp);
+  }
+  brelse(bp);
+  return addr;
+}
 
 // Return the disk block address of the nth block in inode ip.
-// If there is no such block, bmap allocates one.
+// If there is no such block, bmap allocates one.  New data
+// blocks are past the end of the file, so are not zeroed;
+// writei() fills them.
 static uint
 bmap(struct inode *ip, uint bn)
 {
-  uint addr, *a;
-  struct buf *bp;
+  uint addr;
 
   if(bn < NDIRECT){
     if((addr = ip->addrs[bn]) == 0)
-      ip->addrs[bn] = addr = balloc(ip->dev);
+      ip->addrs[bn] = addr = balloc(ip);
     return addr;
   }
   bn -= NDIRECT;
@@ -386,20 +626,97 @@ bmap(struct inode *ip, uint bn)
   if(bn < NINDIRECT){
     // Load indirect block, allocating if necessary.
     if((addr = ip->addrs[NDIRECT]) == 0)
-      ip->addrs[NDIRECT] = addr = balloc(ip->dev);
-    bp = bread(ip->dev, addr);
-    a = (uint*)bp->data;
-    if((addr = a[bn]) == 0){
-      a[bn] = addr = balloc(ip->dev);
-      log_write(bp);
-    }
-    brelse(bp);
-    return addr;
+      ip->addrs[NDIRECT] = addr = balloci(ip);
+    return bmapind(ip, addr, bn, 0);
+  }
+  bn -= NINDIRECT;
+
+  if(bn < NDINDIRECT){
+    // Load double-indirect block, then the indirect block.
+    if((addr = ip->addrs[NDIRECT+1]) == 0)
+      ip->addrs[NDIRECT+1] = addr = balloci(ip);
+    addr = bmapind(ip, addr, bn / NINDIRECT, 1);
+    return bmapind(ip, addr, bn % NINDIRECT, 0);
   }
 
   panic("bmap: out of range");
 }
 
+// Write back ip's file data that bdirty() has held back.
+// Caller holds ip->lock.
+void
+isync(struct inode *ip)
+{
+  struct buf *bp;
+  uint a[NINDIRECT], d[NINDIRECT];
+  int i;
+
+  bsyncv(ip->dev, ip->addrs, NDIRECT);
+  if(ip->addrs[NDIRECT]){
+    bp = bread(ip->dev, ip->addrs[NDIRECT]);
+    memmove(a, bp->data, sizeof(a));
+    brelse(bp);
+    bsyncv(ip->dev, a, NINDIRECT);
+  }
+  if(ip->addrs[NDIRECT+1]){
+    bp = bread(ip->dev, ip->addrs[NDIRECT+1]);
+    memmove(d, bp->data, sizeof(d));
+    brelse(bp);
+    for(i = 0; i < NINDIRECT; i++){
+      if(d[i] == 0)
+        continue;
+      bp = bread(ip->dev, d[i]);
+      memmove(a, bp->data, sizeof(a));
+      brelse(bp);
+      bsyncv(ip->dev, a, NINDIRECT);
+    }
+  }
+}
+
+// Bitmap blocks itrunc() may log in one transaction.  The FS
+// call that frees the inode may have logged 3 blocks already,
+// as unlink() logs the directory, its inode and the file's
+// inode, and itrunc() logs the file's inode once more.
+#define NTRUNCBMAP (MAXOPBLOCKS-3-1)
+
+// Free block b of ip, for itrunc().  A big file's blocks may
+// be marked free in more bitmap blocks than the FS call that
+// frees it can log.  So once the call has logged NTRUNCBMAP
+// of them, write the inode out, end the transaction and start
+// another.  *bb and *n track the bitmap blocks.
+static void
+itruncfree(struct inode *ip, uint b, uint *bb, int *n)
+{
+  if(BBLOCK(b, sb) != *bb){
+    *bb = BBLOCK(b, sb);
+    if(++*n > NTRUNCBMAP){
+      iupdate(ip);
+      end_op();
+      begin_op();
+      *n = 1;
+    }
+  }
+  bfree(ip->dev, b);
+}
+
+// Free indirect block addr and the blocks it lists.
+static void
+itruncind(struct inode *ip, uint addr, uint *bb, int *n)
+{
+  struct buf *bp;
+  uint a[NINDIRECT];
+  int j;
+
+  bp = bread(ip->dev, addr);
+  memmove(a, bp->data, sizeof(a));
+  brelse(bp);
+  for(j = 0; j < NINDIRECT; j++){
+    if(a[j])
+      itruncfree(ip, a[j], bb, n);
+  }
+  itruncfree(ip, addr, bb, n);
+}
+
 // Truncate inode (discard contents).
 // Only called when the inode has no links
 // to it (no directory entries referring to it)
@@ -408,29 +725,36 @@ bmap(struct inode *ip, uint bn)
 static void
 itrunc(struct inode *ip)
 {
-  int i, j;
+  int i, n;
+  uint bb, d[NINDIRECT];
   struct buf *bp;
-  uint *a;
 
+  bb = 0;
+  n = 0;
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
-      bfree(ip->dev, ip->addrs[i]);
+      itruncfree(ip, ip->addrs[i], &bb, &n);
       ip->addrs[i] = 0;
     }
   }
 
   if(ip->addrs[NDIRECT]){
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
-    a = (uint*)bp->data;
-    for(j = 0; j < NINDIRECT; j++){
-      if(a[j])
-        bfree(ip->dev, a[j]);
-    }
-    brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
+    itruncind(ip, ip->addrs[NDIRECT], &bb, &n);
     ip->addrs[NDIRECT] = 0;
   }
 
+  if(ip->addrs[NDIRECT+1]){
+    bp = bread(ip->dev, ip->addrs[NDIRECT+1]);
+    memmove(d, bp->data, sizeof(d));
+    brelse(bp);
+    for(i = 0; i < NINDIRECT; i++){
+      if(d[i])
+        itruncind(ip, d[i], &bb, &n);
+    }
+    itruncfree(ip, ip->addrs[NDIRECT+1], &bb, &n);
+    ip->addrs[NDIRECT+1] = 0;
+  }
+
   ip->size = 0;
   iupdate(ip);
 }
@@ -447,6 +771,37 @@ stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
+// Detect sequential reads of ip, and start reading the blocks
+// of such a read, and up to NREADAHEAD after them, into the
+// buffer cache at once, so that the disk works on them while
+// the reader copies out what has arrived.  A read counts as
+// sequential if it starts in the block where the last one
+// ended.  Caller holds ip->lock.
+static void
+readahead(struct inode *ip, uint off, uint n)
+{
+  uint bn, end, stop;
+
+  bn = off/BSIZE;
+  end = (off + n + BSIZE - 1)/BSIZE;
+  if(bn != ip->seqbn){
+    ip->seqbn = (off + n)/BSIZE;
+    ip->rabn = 0;
+    return;
+  }
+  ip->seqbn = (off + n)/BSIZE;
+
+  // Top up the window only when it runs half empty, so that
+  // readaheads go to the disk in batches.
+  if(ip->rabn < bn)
+    ip->rabn = bn;
+  if(ip->rabn >= end + NREADAHEAD/2)
+    return;
+  stop = min(end + NREADAHEAD, (ip->size + BSIZE - 1)/BSIZE);
+  for(; ip->rabn < stop; ip->rabn++)
+    breadahead(ip->dev, bmap(ip, ip->rabn));
+}
+
 //PAGEBREAK!
 // Read data from inode.
 // Caller must hold ip->lock.
@@ -466,6 +821,8 @@ readi(struct inode *ip, char *dst, uint off, uint n)
     return -1;
   if(off + n > ip->size)
     n = ip->size - off;
+  if(n > 0)
+    readahead(ip, off, n);
 
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
     bp = bread(ip->dev, bmap(ip, off/BSIZE));
@@ -497,10 +854,29 @@ writei(struct inode *ip, char *src, uint off, uint n)
     return -1;
 
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
     m = min(n - tot, BSIZE - off%BSIZE);
+    if(off >= ip->size && off%BSIZE == 0){
+      // A block past the end of the file, most likely just
+      // allocated: its old contents do not matter, so fill it
+      // without reading it, zeroing what the write leaves.
+      // It goes in the log with the allocation, so that the
+      // file never shows stale data after a crash.
+      bp = bfresh(ip->dev, bmap(ip, off/BSIZE));
+      memmove(bp->data, src, m);
+      memset(bp->data + m, 0, BSIZE - m);
+      log_write(bp);
+      brelse(bp);
+      continue;
+    }
+    bp = bread(ip->dev, bmap(ip, off/BSIZE));
     memmove(bp->data + off%BSIZE, src, m);
-    log_write(bp);
+    // File data is written back later, unless the block is
+    // in the log already, as when just allocated: then the
+    // log must carry its latest contents.
+    if(ip->type == T_FILE && bp->nlog == 0)
+      bdirty(bp);
+    else
+      log_write(bp);
     brelse(bp);
   }
 
@@ -1,4 +1,5 @@
-// Simple PIO-based (non-DMA) IDE driver code.
+// IDE driver code.  Uses bus-master DMA if the PCI IDE
+// controller supports it, else programmed I/O.
 
 #include "types.h"
 #include "defs.h"
@@ -12,6 +13,7 @@
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "pci.h"
 
 #define SECTOR_SIZE   512
 #define IDE_BSY       0x80
@@ -23,16 +25,50 @@
 #define IDE_CMD_WRITE 0x30
 #define IDE_CMD_RDMUL 0xc4
 #define IDE_CMD_WRMUL 0xc5
+#define IDE_CMD_RDDMA 0xc8
+#define IDE_CMD_WRDMA 0xca
+#define IDE_MAXSECT   255  // most sectors in one command
 
-// idequeue points to the buf now being read/written to the disk.
-// idequeue->qnext points to the next buf to be processed.
+// idequeue holds the bufs waiting for the disk.  The first
+// idenactive of them are being read/written by the command in
+// progress; the rest follow in elevator order (see idebefore()).
+// idetail points to the last.
 // You must hold idelock while manipulating queue.
 
 static struct spinlock idelock;
 static struct buf *idequeue;
+static struct buf *idetail;
+static int idenactive;
+static uint idepos;         // first block of the last command
 
 static int havedisk1;
 static void idestart(struct buf*);
+static void idedmainit(void);
+
+// Bus-master DMA registers of the primary channel,
+// at an I/O base found in the controller's BAR4.
+#define BM_CMD     0        // command
+#define BM_STATUS  2
+#define BM_PRDT    4        // physical address of PRD table
+
+#define BM_START   0x01     // in BM_CMD
+#define BM_READ    0x08     //   transfer from disk to memory
+#define BM_ERR     0x02     // in BM_STATUS; write 1 to clear
+#define BM_INTR    0x04     //   ditto
+
+#define PCI_IDE_BUSMASTER 0x8000  // in PCI_CLASS: interface can do DMA
+
+// Physical region descriptor: one piece of memory for a
+// DMA transfer.  A piece may not cross a 64 KB boundary.
+struct prd {
+  uint addr;
+  ushort count;             // bytes; 0 means 64 KB
+  ushort flags;
+};
+#define PRD_EOT    0x8000   // last descriptor in the table
+
+static ushort idedma;       // bus-master base, or 0 for PIO
+static struct prd prdt[IDE_MAXSECT] __attribute__((aligned(4096)));
 
 // Wait for IDE disk to become ready.
 static int
@@ -67,31 +103,102 @@ ideinit(void)
 
   // Switch back to disk 0.
   outb(0x1f6, 0xe0 | (0<<4));
+
+  idedmainit();
+}
+
+// Look for a PCI IDE controller that can do bus-master DMA,
+// and turn on its bus mastering.
+static void
+idedmainit(void)
+{
+  uint bdf, bar;
+
+  if(pcifind(PCI_CLASS_STORAGE, PCI_SUBCLASS_IDE, &bdf) < 0)
+    return;
+  if(!(pciread(bdf, PCI_CLASS) & PCI_IDE_BUSMASTER))
+    return;
+  bar = pciread(bdf, PCI_BAR4);
+  if(!(bar & 1) || (bar & ~3) == 0)   // want an I/O port range
+    return;
+  pciwrite(bdf, PCI_COMMAND, pciread(bdf, PCI_COMMAND) | PCI_IOSPACE | PCI_BUSMASTER);
+  idedma = bar & ~3;
+  cprintf("ide: bus-master DMA at 0x%x\n", idedma);
 }
 
-// Start the request for b.  Caller must hold idelock.
+// Point the controller at a PRD table for n bufs starting at b,
+// merging bufs whose data lie next to each other in memory.
+static void
+idedmaprep(struct buf *b, int n)
+{
+  struct prd *d;
+  uint pa;
+  int i;
+
+  d = prdt;
+  for(i = 0; i < n; i++, b = b->qnext){
+    pa = V2P(b->data);
+    if(i > 0 && d->addr + d->count == pa && pa % 0x10000 != 0 &&
+       d->count + BSIZE < 0x10000){
+      d->count += BSIZE;
+      continue;
+    }
+    if(i > 0)
+      d++;
+    d->addr = pa;
+    d->count = BSIZE;
+    d->flags = 0;
+  }
+  d->flags = PRD_EOT;
+
+  outl(idedma + BM_PRDT, V2P(prdt));
+  outb(idedma + BM_STATUS, BM_ERR|BM_INTR);
+}
+
+// Start a command for b and the buffers queued after it
+// for the blocks that follow b's, up to IDE_MAXSECT sectors.
+// With PIO the disk interrupts once per buffer, with DMA once
+// at the end.  Caller must hold idelock.
 static void
 idestart(struct buf *b)
 {
+  struct buf *p;
+  int n;
+
   if(b == 0)
     panic("idestart");
-  if(b->blockno >= FSSIZE)
-    panic("incorrect blockno");
   int sector_per_block =  BSIZE/SECTOR_SIZE;
   int sector = b->blockno * sector_per_block;
+  if(b->blockno >= (1<<28) / sector_per_block)  // LBA28
+    panic("incorrect blockno");
   int read_cmd = (sector_per_block == 1) ? IDE_CMD_READ :  IDE_CMD_RDMUL;
   int write_cmd = (sector_per_block == 1) ? IDE_CMD_WRITE : IDE_CMD_WRMUL;
 
   if (sector_per_block > 7) panic("idestart");
 
+  n = 1;
+  for(p = b; p->qnext && (n+1)*sector_per_block <= IDE_MAXSECT; p = p->qnext){
+    if(p->qnext->dev != b->dev || p->qnext->blockno != p->blockno + 1 ||
+       (p->qnext->flags & B_DIRTY) != (b->flags & B_DIRTY))
+      break;
+    n++;
+  }
+  idenactive = n;
+  idepos = b->blockno;
+  if(idedma)
+    idedmaprep(b, n);
+
   idewait(0);
   outb(0x3f6, 0);  // generate interrupt
-  outb(0x1f2, sector_per_block);  // number of sectors
+  outb(0x1f2, (n*sector_per_block) & 0xff);  // number of sectors
   outb(0x1f3, sector & 0xff);
   outb(0x1f4, (sector >> 8) & 0xff);
   outb(0x1f5, (sector >> 16) & 0xff);
   outb(0x1f6, 0xe0 | ((b->dev&1)<<4) | ((sector>>24)&0x0f));
-  if(b->flags & B_DIRTY){
+  if(idedma){
+    outb(0x1f7, (b->flags & B_DIRTY) ? IDE_CMD_WRDMA : IDE_CMD_RDDMA);
+    outb(idedma + BM_CMD, ((b->flags & B_DIRTY) ? 0 : BM_READ) | BM_START);
+  } else if(b->flags & B_DIRTY){
     outb(0x1f7, write_cmd);
     outsl(0x1f0, b->data, BSIZE/4);
   } else {
@@ -99,70 +206,164 @@ idestart(struct buf *b)
   }
 }
 
+// Does a come before b in the elevator order?  The disk
+// sweeps upward from idepos, then starts again at the bottom.
+static int
+idebefore(struct buf *a, struct buf *b)
+{
+  int wa = a->blockno < idepos;
+  int wb = b->blockno < idepos;
+
+  return wa != wb ? wa < wb : a->blockno < b->blockno;
+}
+
+// Add b to idequeue in elevator order, after the buffers of
+// the command in progress.  Usually b belongs at the end, as
+// when a file is read or the log written in order, and then
+// this takes constant time.  Caller must hold idelock.
+static void
+ideenqueue(struct buf *b)
+{
+  struct buf **pp;
+  int i;
+
+  b->qnext = 0;
+  if(idequeue == 0){
+    idequeue = idetail = b;
+    return;
+  }
+  if(!idebefore(b, idetail)){
+    idetail->qnext = b;
+    idetail = b;
+    return;
+  }
+  pp = &idequeue;
+  for(i = 0; i < idenactive; i++)
+    pp = &(*pp)->qnext;
+  while(*pp && !idebefore(b, *pp))
+    pp = &(*pp)->qnext;
+  b->qnext = *pp;
+  *pp = b;
+  if(b->qnext == 0)
+    idetail = b;
+}
+
 // Interrupt handler.
 void
 ideintr(void)
 {
-  struct buf *b;
+  struct buf *b, *done;
+  int n, st;
 
   // First queued buffer is the active request.
   acquire(&idelock);
 
-  if((b = idequeue) == 0){
+  if(idequeue == 0){
     release(&idelock);
     return;
   }
-  idequeue = b->qnext;
 
-  // Read data if needed.
-  if(!(b->flags & B_DIRTY) && idewait(1) >= 0)
-    insl(0x1f0, b->data, BSIZE/4);
+  if(idedma){
+    // The whole command is done.
+    st = inb(idedma + BM_STATUS);
+    outb(idedma + BM_CMD, 0);
+    outb(idedma + BM_STATUS, BM_ERR|BM_INTR);
+    if((st & BM_ERR) || idewait(1) < 0){
+      cprintf("ide: DMA failed; using PIO\n");
+      idedma = 0;
+      idestart(idequeue);
+      release(&idelock);
+      return;
+    }
+    n = idenactive;
+  } else {
+    // Read data if needed.
+    n = 1;
+    if(!(idequeue->flags & B_DIRTY) && idewait(1) >= 0)
+      insl(0x1f0, idequeue->data, BSIZE/4);
+  }
 
-  // Wake process waiting for this buf.
-  b->flags |= B_VALID;
-  b->flags &= ~B_DIRTY;
-  wakeup(b);
+  // Wake processes waiting for these bufs.  Nobody waits
+  // for a readahead; collect those to hand back below.
+  done = 0;
+  while(n-- > 0){
+    b = idequeue;
+    if((idequeue = b->qnext) == 0)
+      idetail = 0;
+    idenactive--;
+    b->flags |= B_VALID;
+    b->flags &= ~B_DIRTY;
+    if(b->flags & B_ASYNC){
+      b->qnext = done;
+      done = b;
+    }
+    wakeup(b);
+  }
 
-  // Start disk on next buf in queue.
-  if(idequeue != 0)
+  // Go on with the command in progress, or start the disk
+  // on the next buf in queue.
+  if(idenactive > 0){
+    if(idequeue->flags & B_DIRTY){
+      idewait(0);
+      outsl(0x1f0, idequeue->data, BSIZE/4);
+    }
+  } else if(idequeue != 0)
     idestart(idequeue);
 
   release(&idelock);
+
+  while((b = done) != 0){
+    done = b->qnext;
+    bdone(b);
+  }
 }
 
 //PAGEBREAK!
 // Sync buf with disk.
 // If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
 // Else if B_VALID is not set, read buf from disk, set B_VALID.
+// If B_ASYNC is set, return at once; ideintr() calls bdone()
+// when the read finishes.
 void
 iderw(struct buf *b)
 {
-  struct buf **pp;
+  iderwv(&b, 1);
+}
 
-  if(!holdingsleep(&b->lock))
-    panic("iderw: buf not locked");
-  if((b->flags & (B_VALID|B_DIRTY)) == B_VALID)
-    panic("iderw: nothing to do");
-  if(b->dev != 0 && !havedisk1)
-    panic("iderw: ide disk 1 not present");
+// Sync n bufs with disk, as iderw() does, queueing them all
+// before waiting for any, so that the disk can sort them and
+// do runs of adjacent blocks in one command.
+void
+iderwv(struct buf **bs, int n)
+{
+  struct buf *b;
+  int i;
+
+  for(i = 0; i < n; i++){
+    b = bs[i];
+    if(!holdingsleep(&b->lock))
+      panic("iderw: buf not locked");
+    if((b->flags & (B_VALID|B_DIRTY)) == B_VALID)
+      panic("iderw: nothing to do");
+    if(b->dev != 0 && !havedisk1)
+      panic("iderw: ide disk 1 not present");
+  }
 
   acquire(&idelock);  //DOC:acquire-lock
 
-  // Append b to idequeue.
-  b->qnext = 0;
-  for(pp=&idequeue; *pp; pp=&(*pp)->qnext)  //DOC:insert-queue
-    ;
-  *pp = b;
+  for(i = 0; i < n; i++)
+    ideenqueue(bs[i]);  //DOC:insert-queue
 
   // Start disk if necessary.
-  if(idequeue == b)
-    idestart(b);
+  if(idenactive == 0)
+    idestart(idequeue);
 
-  // Wait for request to finish.
-  while((b->flags & (B_VALID|B_DIRTY)) != B_VALID){
-    sleep(b, &idelock);
+  // Wait for requests to finish.
+  for(i = 0; i < n; i++){
+    b = bs[i];
+    while(!(b->flags & B_ASYNC) && (b->flags & (B_VALID|B_DIRTY)) != B_VALID)
+      sleep(b, &idelock);
   }
 
-
   release(&idelock);
 }
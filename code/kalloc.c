@@ -17,21 +17,56 @@ struct run {
   struct run *next;
 };
 
+// Pages move between a CPU's cache and the global
+// free list KBATCH at a time, so that kmem.lock is
+// taken once per batch rather than once per page.
+#define KBATCH     32
+#define KCACHEMAX  (2*KBATCH)  // drain a batch when a cache holds this many
+
+// Per-CPU cache of free pages.  Only its own CPU adds
+// pages to it; other CPUs take pages from it only when
+// everything else is empty (see ksteal).
+struct kcache {
+  struct spinlock lock;
+  struct run *freelist;
+  int nfree;
+  uint nsteal;   // pages this CPU has taken from other caches
+};
+
 struct {
   struct spinlock lock;
   int use_lock;
   struct run *freelist;
+  int nfree;     // pages on the global list
+  int npages;    // pages handed to the allocator at boot
+  struct kcache cache[NCPU];
 } kmem;
 
+// Reference counts of physical pages, so that fork() can
+// share pages copy-on-write.  kalloc() sets a page's count
+// to 1, kdup() adds a reference and kfree() only frees the
+// page when the last reference goes away.
+struct {
+  struct spinlock lock;
+  ushort ref[PHYSTOP/PGSIZE];
+} pgref;
+
 // Initialization happens in two phases.
 // 1. main() calls kinit1() while still using entrypgdir to place just
 // the pages mapped by entrypgdir on free list.
 // 2. main() calls kinit2() with the rest of the physical pages
 // after installing a full page table that maps them on all cores.
+// Until kinit2() returns only the global free list is used,
+// since the other CPUs are not known yet.
 void
 kinit1(void *vstart, void *vend)
 {
+  int i;
+
   initlock(&kmem.lock, "kmem");
+  initlock(&pgref.lock, "pgref");
+  for(i = 0; i < NCPU; i++)
+    initlock(&kmem.cache[i].lock, "kcache");
   kmem.use_lock = 0;
   freerange(vstart, vend);
 }
@@ -48,8 +83,10 @@ freerange(void *vstart, void *vend)
 {
   char *p;
   p = (char*)PGROUNDUP((uint)vstart);
-  for(; p + PGSIZE <= (char*)vend; p += PGSIZE)
+  for(; p + PGSIZE <= (char*)vend; p += PGSIZE){
+    kmem.npages++;
     kfree(p);
+  }
 }
 //PAGEBREAK: 21
 // Free the page of physical memory pointed at by v,
@@ -59,21 +96,92 @@ freerange(void *vstart, void *vend)
 void
 kfree(char *v)
 {
-  struct run *r;
+  struct run *r, *batch;
+  struct kcache *c;
+  int n;
 
   if((uint)v % PGSIZE || v < end || V2P(v) >= PHYSTOP)
     panic("kfree");
 
+  if(kmem.use_lock){
+    acquire(&pgref.lock);
+    if(pgref.ref[V2P(v)/PGSIZE] > 1){
+      pgref.ref[V2P(v)/PGSIZE]--;
+      release(&pgref.lock);
+      return;
+    }
+    pgref.ref[V2P(v)/PGSIZE] = 0;
+    release(&pgref.lock);
+  }
+
   // Fill with junk to catch dangling refs.
   memset(v, 1, PGSIZE);
 
-  if(kmem.use_lock)
-    acquire(&kmem.lock);
   r = (struct run*)v;
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  if(kmem.use_lock)
+  if(!kmem.use_lock){
+    r->next = kmem.freelist;
+    kmem.freelist = r;
+    kmem.nfree++;
+    return;
+  }
+
+  pushcli();
+  c = &kmem.cache[cpuid()];
+  acquire(&c->lock);
+  r->next = c->freelist;
+  c->freelist = r;
+  c->nfree++;
+  if(c->nfree >= KCACHEMAX){
+    // Give a batch back to the global list.
+    batch = c->freelist;
+    for(r = batch, n = 1; n < KBATCH; n++)
+      r = r->next;
+    c->freelist = r->next;
+    c->nfree -= KBATCH;
+    acquire(&kmem.lock);
+    r->next = kmem.freelist;
+    kmem.freelist = batch;
+    kmem.nfree += KBATCH;
     release(&kmem.lock);
+  }
+  release(&c->lock);
+  popcli();
+}
+
+// Take half of the pages cached by some other CPU
+// and give them to cache c.  Returns one of them,
+// or 0 if every cache is empty.
+static struct run*
+ksteal(struct kcache *c)
+{
+  struct kcache *o;
+  struct run *r, *last;
+  int n, i;
+
+  for(o = kmem.cache; o < &kmem.cache[NCPU]; o++){
+    if(o == c)
+      continue;
+    acquire(&o->lock);
+    if((r = o->freelist) == 0){
+      release(&o->lock);
+      continue;
+    }
+    n = (o->nfree + 1) / 2;
+    for(last = r, i = 1; i < n; i++)
+      last = last->next;
+    o->freelist = last->next;
+    o->nfree -= n;
+    release(&o->lock);
+
+    acquire(&c->lock);
+    c->nsteal += n;
+    last->next = c->freelist;
+    c->freelist = r->next;
+    c->nfree += n - 1;
+    release(&c->lock);
+    return r;
+  }
+  return 0;
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -82,15 +190,92 @@ kfree(char *v)
 char*
 kalloc(void)
 {
-  struct run *r;
+  struct run *r, *last;
+  struct kcache *c;
+  int n;
+
+  if(!kmem.use_lock){
+    r = kmem.freelist;
+    if(r){
+      kmem.freelist = r->next;
+      kmem.nfree--;
+      pgref.ref[V2P(r)/PGSIZE] = 1;
+    }
+    return (char*)r;
+  }
 
-  if(kmem.use_lock)
+  pushcli();
+  c = &kmem.cache[cpuid()];
+  acquire(&c->lock);
+  if(c->freelist == 0){
+    // Refill a batch from the global list.
     acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  if(kmem.use_lock)
+    if((r = kmem.freelist) != 0){
+      for(last = r, n = 1; n < KBATCH && last->next; n++)
+        last = last->next;
+      kmem.freelist = last->next;
+      kmem.nfree -= n;
+      last->next = 0;
+      c->freelist = r;
+      c->nfree = n;
+    }
     release(&kmem.lock);
+  }
+  if((r = c->freelist) != 0){
+    c->freelist = r->next;
+    c->nfree--;
+  }
+  release(&c->lock);
+  if(r == 0)
+    r = ksteal(c);
+  popcli();
+  if(r)
+    pgref.ref[V2P(r)/PGSIZE] = 1;
   return (char*)r;
 }
 
+// Add a reference to the page at v, which another
+// page table is about to map.
+void
+kdup(char *v)
+{
+  if((uint)v % PGSIZE || v < end || V2P(v) >= PHYSTOP)
+    panic("kdup");
+  acquire(&pgref.lock);
+  if(pgref.ref[V2P(v)/PGSIZE] < 1)
+    panic("kdup: free page");
+  pgref.ref[V2P(v)/PGSIZE]++;
+  release(&pgref.lock);
+}
+
+// Return the number of references to the page at v.
+int
+krefcnt(char *v)
+{
+  int n;
+
+  acquire(&pgref.lock);
+  n = pgref.ref[V2P(v)/PGSIZE];
+  release(&pgref.lock);
+  return n;
+}
+
+// Report the number of free pages, pages in use,
+// and pages that CPUs have stolen from each other's caches.
+// The counts are read without locks, so they are a snapshot.
+void
+kmemstat(uint *nfree, uint *nused, uint *nsteal)
+{
+  struct kcache *c;
+  uint f, st;
+
+  f = kmem.nfree;
+  st = 0;
+  for(c = kmem.cache; c < &kmem.cache[NCPU]; c++){
+    f += c->nfree;
+    st += c->nsteal;
+  }
+  *nfree = f;
+  *nused = kmem.npages - f;
+  *nsteal = st;
+}
@@ -0,0 +1,57 @@
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "fcntl.h"
+
+#define BIG (64*1024*1024)
+
+// sbrk() only reserves address space; pages appear,
+// zeroed, when the program or the kernel first touches them.
+int
+main(int argc, char *argv[])
+{
+  char *p;
+  int i, fd;
+
+  if((p = sbrk(BIG)) == (char*)-1){
+    printf(1, "lazy_test: sbrk FAILED\n");
+    exit();
+  }
+  for(i = 0; i < BIG; i += BIG/16){
+    if(p[i] != 0){
+      printf(1, "lazy_test: page not zeroed\n");
+      exit();
+    }
+    p[i] = 'x';
+  }
+
+  // The kernel writes into and reads from untouched pages.
+  if((fd = open("lazy_test.tmp", O_CREATE|O_RDWR)) < 0 ||
+     write(fd, p + BIG - 4096, 512) != 512){
+    printf(1, "lazy_test: write from untouched page FAILED\n");
+    exit();
+  }
+  close(fd);
+  fd = open("lazy_test.tmp", O_RDONLY);
+  if(fd < 0 || read(fd, p + BIG/2 + 4096, 512) != 512){
+    printf(1, "lazy_test: read into untouched page FAILED\n");
+    exit();
+  }
+  close(fd);
+  unlink("lazy_test.tmp");
+
+  // A forked child sees the touched pages and can touch more.
+  if(fork() == 0){
+    if(p[0] != 'x' || p[BIG-1] != 0)
+      printf(1, "lazy_test: fork FAILED\n");
+    exit();
+  }
+  wait();
+
+  if(sbrk(-BIG) == (char*)-1){
+    printf(1, "lazy_test: shrink FAILED\n");
+    exit();
+  }
+  printf(1, "lazy_test: ok\n");
+  exit();
+}
@@ -9,7 +9,7 @@
 // Simple logging that allows concurrent FS system calls.
 //
 // A log transaction contains the updates of multiple FS system
-// calls. The logging system only commits when there are
+// calls. A transaction is only closed when there are
 // no FS system calls active. Thus there is never
 // any reasoning required about whether a commit might
 // write an uncommitted system call's updates to disk.
@@ -18,192 +18,390 @@
 // its start and end. Usually begin_op() just increments
 // the count of in-progress FS system calls and returns.
 // But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// sleeps until the transaction has been closed.
 //
-// The log is a physical re-do log containing disk blocks.
-// The on-disk log format:
-//   header block, containing block #s for block A, B, C, ...
+// The on-disk log has two areas, so that one transaction can
+// take new system calls while the other is being committed.
+// Closing a transaction copies its blocks into the log's
+// buffers and hands it to the logflush kernel thread, which
+// writes the log, commits, and installs the blocks in their
+// home locations while system calls go on.  A transaction is
+// closed by the last end_op() once the previous one has been
+// installed, or by logflush when it finishes the previous one;
+// so while the disk is busy, system calls are grouped into
+// larger transactions.
+//
+// mkfs -l sets the size of the areas.  Each has the on-disk
+// format:
+//   LOGHDR header blocks, containing a sequence number and
+//     block #s for block A, B, C, ...; the first block,
+//     which holds the count, is written last
 //   block A
 //   block B
 //   block C
 //   ...
-// Log appends are synchronous.
+// write_log() and install_trans() give the disk NBATCH blocks
+// at a time, so that it can write runs of them with one command.
+
+#define NBATCH 16
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+// Header blocks needed for a transaction of n blocks.
+#define HDRBLOCKS(n) (((2+(n))*sizeof(int) + BSIZE-1) / BSIZE)
 
-// Contents of the header block, used for both the on-disk header block
+// Contents of the header blocks, used for both the on-disk header
 // and to keep track in memory of logged block# before commit.
 struct logheader {
+  int seq;
   int n;
   int block[LOGSIZE];
 };
 
+// A transaction, using one area of the log.
+struct trans {
+  int start;                // header block of its area
+  int committing;           // closed; waiting for logflush
+  struct logheader lh;
+  struct buf *home[LOGSIZE];  // the cached blocks, pinned until installed
+  struct buf *copy[LOGSIZE];  // their log blocks, pinned likewise
+};
+
 struct log {
   struct spinlock lock;
-  int start;
-  int size;
+  int size;        // data blocks in each area
+  int disksize;    // data blocks each area has room for on disk
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int reserved;    // blocks they may still log; see begin_opn()
+  int closing;     // in close_trans(), please wait.
   int dev;
-  struct logheader lh;
+  int seq;         // for the next transaction to be closed
+  int done;        // seq of the last one installed
+  int cur;         // t[cur] takes new FS sys calls
+  int next;        // logflush does t[next] next
+  struct trans t[2];
 };
 struct log log;
 
+// For install_trans() to write log blocks to their home
+// locations without disturbing the cached copies there,
+// which may be newer.  Used only by one thread at a time.
+static struct buf ibuf[NBATCH];
+
 static void recover_from_log(void);
-static void commit();
+static void logflush(void);
 
 void
 initlog(int dev)
 {
-  if (sizeof(struct logheader) >= BSIZE)
-    panic("initlog: too big logheader");
-
   struct superblock sb;
+  uint nbuf, nhit, nmiss, nwb;
+  int i;
+
   initlock(&log.lock, "log");
+  for (i = 0; i < NBATCH; i++)
+    initsleeplock(&ibuf[i].lock, "logibuf");
   readsb(dev, &sb);
-  log.start = sb.logstart;
-  log.size = sb.nlog;
+  // Two transactions' blocks and their copies stay pinned
+  // in the buffer cache; leave plenty for everything else.
+  bstat(&nbuf, &nhit, &nmiss, &nwb);
+  log.disksize = min(sb.nlog/2 - LOGHDR, LOGSIZE);
+  log.size = min(log.disksize, nbuf/8);
+  if (log.size < 3*MAXOPBLOCKS)
+    panic("initlog: log too small");
+  log.t[0].start = sb.logstart;
+  log.t[1].start = sb.logstart + sb.nlog/2;
   log.dev = dev;
   recover_from_log();
+  kthread("logflush", logflush);
 }
 
-// Copy committed blocks from log to their home location
+// Copy committed blocks of t from log to their home location
 static void
-install_trans(void)
+install_trans(struct trans *t)
 {
-  int tail;
+  struct buf *lbuf[NBATCH], *dbuf[NBATCH];
+  int tail, i, n;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    brelse(lbuf);
-    brelse(dbuf);
+  for (tail = 0; tail < t->lh.n; tail += n) {
+    n = min(t->lh.n - tail, NBATCH);
+    for (i = 0; i < n; i++) {
+      lbuf[i] = bread(log.dev, t->start+LOGHDR+tail+i); // read log block
+      dbuf[i] = &ibuf[i];
+      acquiresleep(&dbuf[i]->lock);
+      dbuf[i]->dev = log.dev;
+      dbuf[i]->blockno = t->lh.block[tail+i];  // dst
+      dbuf[i]->data = lbuf[i]->data;
+      dbuf[i]->flags = B_DIRTY;
+    }
+    iderwv(dbuf, n);  // write dst to disk
+    for (i = 0; i < n; i++) {
+      releasesleep(&dbuf[i]->lock);
+      brelse(lbuf[i]);
+    }
   }
 }
 
-// Read the log header from disk into the in-memory log header
+// Read the log header of t from disk into the in-memory log header
 static void
-read_head(void)
+read_head(struct trans *t)
 {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *lh = (struct logheader *) (buf->data);
-  int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
+  struct buf *buf;
+  int i, nh;
+
+  for (i = 0, nh = 1; i < nh; i++) {
+    buf = bread(log.dev, t->start+i);
+    memmove((char*)&t->lh + i*BSIZE, buf->data, min(BSIZE, sizeof(t->lh) - i*BSIZE));
+    brelse(buf);
+    if (i == 0) {
+      // Check against the area, not log.size: a kernel with
+      // a bigger buffer cache may have written t.
+      if (t->lh.n < 0 || t->lh.n > log.disksize)
+        panic("read_head");
+      nh = HDRBLOCKS(t->lh.n);
+    }
   }
-  brelse(buf);
 }
 
-// Write in-memory log header to disk.
-// This is the true point at which the
-// current transaction commits.
+// Write in-memory log header of t to disk.
+// Writing the first block is the true point at which the
+// transaction commits.
 static void
-write_head(void)
+write_head(struct trans *t)
 {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *hb = (struct logheader *) (buf->data);
-  int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
+  struct buf *buf[LOGHDR];
+  int i, nh;
+
+  nh = HDRBLOCKS(t->lh.n);
+  if (nh < 1 || nh > LOGHDR)
+    panic("write_head");
+  for (i = 0; i < nh; i++) {
+    buf[i] = bfresh(log.dev, t->start+i);
+    memmove(buf[i]->data, (char*)&t->lh + i*BSIZE, min(BSIZE, sizeof(t->lh) - i*BSIZE));
   }
-  bwrite(buf);
-  brelse(buf);
+  if (nh > 1)
+    bwritev(buf+1, nh-1);
+  bwrite(buf[0]);
+  for (i = 0; i < nh; i++)
+    brelse(buf[i]);
 }
 
+// Install whatever committed transactions the log holds,
+// older first, and clear the log.
 static void
 recover_from_log(void)
 {
-  read_head();
-  install_trans(); // if committed, copy from log to disk
-  log.lh.n = 0;
-  write_head(); // clear the log
+  struct trans *t0 = &log.t[0], *t1 = &log.t[1];
+
+  read_head(t0);
+  read_head(t1);
+  if (t0->lh.n > 0 && t1->lh.n > 0 && t1->lh.seq < t0->lh.seq) {
+    t0 = &log.t[1];
+    t1 = &log.t[0];
+  }
+  install_trans(t0); // if committed, copy from log to disk
+  install_trans(t1);
+  log.seq = (t0->lh.seq > t1->lh.seq ? t0->lh.seq : t1->lh.seq) + 1;
+  log.done = log.seq - 1;
+  t0->lh.n = t1->lh.n = 0;
+  write_head(t0); // clear the log
+  write_head(t1);
+}
+
+// Copy the blocks of t from the cache into its area's buffers,
+// where they stay until logflush is done with them, so that
+// later transactions can go on changing the cached blocks.
+// Called with no FS sys calls executing and log.closing set.
+static void
+close_trans(struct trans *t)
+{
+  int i;
+
+  for (i = 0; i < t->lh.n; i++) {
+    struct buf *to = bfresh(log.dev, t->start+LOGHDR+i); // log block
+    struct buf *from = bread(log.dev, t->lh.block[i]); // cache block
+    memmove(to->data, from->data, BSIZE);
+    bpin(to);
+    t->copy[i] = to;
+    brelse(from);
+    brelse(to);
+  }
+
+  acquire(&log.lock);
+  t->lh.seq = log.seq++;
+  t->committing = 1;
+  log.cur = 1 - log.cur;
+  log.closing = 0;
+  wakeup(&log);
+  release(&log.lock);
+}
+
+// Should the current transaction be closed?  Only if no FS sys
+// calls are executing and logflush is free to take it.
+// Caller holds log.lock; if this returns 1, it must call
+// close_trans(&log.t[log.cur]).
+static int
+want_close(void)
+{
+  struct trans *t = &log.t[log.cur];
+
+  if (log.outstanding > 0 || log.closing || t->lh.n == 0 ||
+      log.t[1 - log.cur].committing)
+    return 0;
+  log.closing = 1;
+  return 1;
 }
 
 // called at the start of each FS system call.
 void
 begin_op(void)
 {
+  begin_opn(MAXOPBLOCKS);
+}
+
+// called at the end of each FS system call.
+void
+end_op(void)
+{
+  end_opn(MAXOPBLOCKS);
+}
+
+// Most blocks one FS sys call may write.
+int
+log_opmax(void)
+{
+  return log.size/2;
+}
+
+// Start an FS system call that writes at most n blocks.
+void
+begin_opn(int n)
+{
+  struct trans *t;
+
+  if(n > log_opmax())
+    panic("begin_op: too many blocks");
   acquire(&log.lock);
   while(1){
-    if(log.committing){
+    t = &log.t[log.cur];
+    if(log.closing || t->committing){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
+    } else if(t->lh.n + log.reserved + n > log.size){
       // this op might exhaust log space; wait for commit.
       sleep(&log, &log.lock);
     } else {
       log.outstanding += 1;
+      log.reserved += n;
       release(&log.lock);
       break;
     }
   }
 }
 
-// called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// End an FS system call started by begin_opn(n).
+// closes the transaction if this was the last outstanding
+// operation and logflush is idle.
 void
-end_op(void)
+end_opn(int n)
 {
-  int do_commit = 0;
+  int do_close;
 
   acquire(&log.lock);
   log.outstanding -= 1;
-  if(log.committing)
-    panic("log.committing");
-  if(log.outstanding == 0){
-    do_commit = 1;
-    log.committing = 1;
-  } else {
+  log.reserved -= n;
+  do_close = want_close();
+  if(!do_close){
     // begin_op() may be waiting for log space,
-    // and decrementing log.outstanding has decreased
+    // and decrementing log.reserved has decreased
     // the amount of reserved space.
     wakeup(&log);
   }
   release(&log.lock);
 
-  if(do_commit){
-    // call commit w/o holding locks, since not allowed
+  if(do_close){
+    // call close_trans w/o holding locks, since not allowed
     // to sleep with locks.
-    commit();
-    acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
-    release(&log.lock);
+    close_trans(&log.t[log.cur]);
   }
 }
 
-// Copy modified blocks from cache to log.
+// Write the blocks of t from the log's buffers to the log.
 static void
-write_log(void)
+write_log(struct trans *t)
 {
-  int tail;
+  struct buf *to[NBATCH];
+  int tail, i, n;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
-    brelse(from);
-    brelse(to);
+  for (tail = 0; tail < t->lh.n; tail += n) {
+    n = min(t->lh.n - tail, NBATCH);
+    for (i = 0; i < n; i++)
+      to[i] = bread(log.dev, t->start+LOGHDR+tail+i); // log block
+    bwritev(to, n);  // write the log
+    for (i = 0; i < n; i++)
+      brelse(to[i]);
   }
 }
 
+// Commit closed transactions, in order, and install them.
 static void
-commit()
-{
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(); // Now install writes to home locations
-    log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+logflush(void)
+{
+  struct trans *t;
+  int i, do_close;
+
+  for(;;){
+    acquire(&log.lock);
+    t = &log.t[log.next];
+    while(!t->committing)
+      sleep(&log, &log.lock);
+    release(&log.lock);
+
+    write_log(t);     // Write modified blocks to log
+    write_head(t);    // Write header to disk -- the real commit
+    install_trans(t); // Now install writes to home locations
+    acquire(&log.lock);
+    for (i = 0; i < t->lh.n; i++)
+      t->home[i]->nlog--;
+    release(&log.lock);
+    for (i = 0; i < t->lh.n; i++) {
+      bunpin(t->home[i]);
+      bunpin(t->copy[i]);
+    }
+    t->lh.n = 0;
+    write_head(t);    // Erase the transaction from the log
+
+    acquire(&log.lock);
+    log.done = t->lh.seq;
+    t->committing = 0;
+    log.next = 1 - log.next;
+    do_close = want_close();
+    wakeup(&log);
+    release(&log.lock);
+
+    // The transaction that filled up meanwhile.
+    if(do_close)
+      close_trans(&log.t[log.cur]);
   }
 }
 
+// Wait until everything logged so far is installed.
+// Caller must not be inside begin_op()/end_op().
+void
+log_sync(void)
+{
+  int seq;
+
+  acquire(&log.lock);
+  // The current transaction, if it has anything, closes as
+  // soon as the FS sys calls in it end and logflush is free.
+  seq = log.t[log.cur].lh.n > 0 ? log.seq : log.seq - 1;
+  while (log.done < seq)
+    sleep(&log, &log.lock);
+  release(&log.lock);
+}
+
 // Caller has modified b->data and is done with the buffer.
-// Record the block number and pin in the cache with B_DIRTY.
-// commit()/write_log() will do the disk write.
+// Record the block number and pin it in the cache.
+// logflush will do the disk write.
 //
 // log_write() replaces bwrite(); a typical use is:
 //   bp = bread(...)
@@ -213,22 +411,27 @@ commit()
 void
 log_write(struct buf *b)
 {
+  struct trans *t;
   int i;
 
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
-    panic("too big a transaction");
   if (log.outstanding < 1)
     panic("log_write outside of trans");
 
   acquire(&log.lock);
-  for (i = 0; i < log.lh.n; i++) {
-    if (log.lh.block[i] == b->blockno)   // log absorbtion
+  t = &log.t[log.cur];
+  for (i = 0; i < t->lh.n; i++) {
+    if (t->lh.block[i] == b->blockno)   // log absorbtion
       break;
   }
-  log.lh.block[i] = b->blockno;
-  if (i == log.lh.n)
-    log.lh.n++;
-  b->flags |= B_DIRTY; // prevent eviction
+  if (i == t->lh.n) {
+    if (t->lh.n >= log.size)
+      panic("too big a transaction");
+    t->lh.block[i] = b->blockno;
+    t->home[i] = b;
+    t->lh.n++;
+    b->nlog++;
+    bpin(b); // prevent eviction
+  }
+  bclean(b);  // the log will write it
   release(&log.lock);
 }
-
@@ -27,12 +27,16 @@ main(void)
   consoleinit();   // console hardware
   uartinit();      // serial port
   pinit();         // process table
+  vmsinit();       // address spaces
   tvinit();        // trap vectors
-  binit();         // buffer cache
+  icacheinit();    // inode cache
   fileinit();      // file table
+  pipeinit();      // pipe buffers
+  shminit();       // shared memory segments
   ideinit();       // disk 
   startothers();   // start other processors
   kinit2(P2V(4*1024*1024), P2V(PHYSTOP)); // must come after startothers()
+  binit();         // buffer cache, sized from free memory
   userinit();      // first user process
   mpmain();        // finish this processor's setup
 }
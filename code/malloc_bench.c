@@ -0,0 +1,86 @@
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "uthread.h"
+
+#define NSLOT   256         // live blocks per round
+#define ROUNDS  200
+#define NTHREAD 4
+
+static volatile int failed;
+
+static uint
+rnd(uint *seed)
+{
+  *seed = *seed * 1103515245 + 12345;
+  return (*seed >> 16) & 0x7fff;
+}
+
+// Keep NSLOT blocks live, replacing a random one at a time,
+// with sizes from 1 to max bytes.  Each block is filled
+// with its own tag, which is checked before it is freed.
+static void
+churn(uint seed, uint max, int rounds)
+{
+  char *p[NSLOT];
+  uint sz[NSLOT];
+  int i, j, r;
+
+  memset(p, 0, sizeof(p));
+  for(r = 0; r < rounds; r++){
+    for(i = 0; i < NSLOT; i++){
+      j = rnd(&seed) % NSLOT;
+      if(p[j]){
+        if(p[j][0] != (char)j || p[j][sz[j]-1] != (char)j)
+          failed = 1;
+        free(p[j]);
+      }
+      sz[j] = rnd(&seed) % max + 1;
+      if((p[j] = malloc(sz[j])) == 0){
+        failed = 1;
+        return;
+      }
+      p[j][0] = p[j][sz[j]-1] = j;
+    }
+  }
+  for(i = 0; i < NSLOT; i++)
+    free(p[i]);
+}
+
+static void
+worker(void *arg)
+{
+  churn((uint)arg, 256, ROUNDS);
+}
+
+// Times malloc()/free() for small and large blocks,
+// and for small blocks from several threads at once.
+int
+main(int argc, char *argv[])
+{
+  int i, t, tids[NTHREAD];
+
+  t = uptime();
+  churn(1, 256, ROUNDS);
+  printf(1, "malloc_bench: small: %d ticks for %d pairs\n",
+         uptime() - t, NSLOT*ROUNDS);
+
+  t = uptime();
+  churn(2, 64*1024, ROUNDS/10);
+  printf(1, "malloc_bench: large: %d ticks for %d pairs\n",
+         uptime() - t, NSLOT*ROUNDS/10);
+
+  t = uptime();
+  for(i = 0; i < NTHREAD; i++)
+    tids[i] = uthread_create(worker, (void*)(i+3));
+  for(i = 0; i < NTHREAD; i++)
+    uthread_join(tids[i]);
+  printf(1, "malloc_bench: %d threads: %d ticks for %d pairs\n",
+         NTHREAD, uptime() - t, NTHREAD*NSLOT*ROUNDS);
+
+  if(failed)
+    printf(1, "malloc_bench: FAILED\n");
+  else
+    printf(1, "malloc_bench: ok\n");
+  exit();
+}
@@ -0,0 +1,20 @@
+// Memory usage, as reported by the meminfo() system call.
+// Page counts are in PGSIZE pages.
+struct meminfo {
+  uint npages;          // pages managed by kalloc()
+  uint nfree;           // of those, free
+  uint nsteal;          // pages CPUs took from each other's caches
+  uint nptpages;        // page directories and page tables
+  uint nswap;           // swap slots
+  uint nswapused;
+  int npipe;            // open pipes
+  int npipepages;       //   slab pages holding them
+  int ninode;           // in-memory inodes
+  int ninodepages;
+  int nfile;            // open files
+  int nfilepages;
+  uint nbuf;            // disk block cache buffers
+  uint nbhit;           // block lookups that hit in the cache
+  uint nbmiss;
+  uint nbwb;            // buffers holding file data not yet on disk
+};
@@ -0,0 +1,7 @@
+// mmap() protections and flags.
+#define PROT_READ   0x1
+#define PROT_WRITE  0x2
+
+#define MAP_SHARED  0x01
+#define MAP_PRIVATE 0x02
+#define MAP_ANON    0x20
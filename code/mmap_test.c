@@ -0,0 +1,90 @@
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "fcntl.h"
+#include "mman.h"
+
+#define FILESZ (3*4096 + 100)
+
+static char buf[FILESZ];
+
+static void
+fail(char *what)
+{
+  printf(1, "mmap_test: %s FAILED\n", what);
+  unlink("mmap_test.tmp");
+  exit();
+}
+
+int
+main(int argc, char *argv[])
+{
+  int fd, i;
+  char *p, *q;
+
+  for(i = 0; i < FILESZ; i++)
+    buf[i] = 'a' + i % 26;
+  if((fd = open("mmap_test.tmp", O_CREATE|O_RDWR)) < 0 ||
+     write(fd, buf, FILESZ) != FILESZ)
+    fail("create");
+
+  // A private mapping reads the file, is zero past its end,
+  // and keeps its writes to itself.
+  p = mmap(0, FILESZ + 4096, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(p == (char*)-1)
+    fail("mmap private");
+  for(i = 0; i < FILESZ; i++)
+    if(p[i] != buf[i])
+      fail("private contents");
+  if(p[FILESZ] != 0 || p[FILESZ+4095] != 0)
+    fail("private zero fill");
+  p[0] = 'X';
+  if(munmap(p, FILESZ + 4096) < 0)
+    fail("munmap private");
+
+  // write() straight out of a read-only mapping.
+  p = mmap(0, FILESZ, PROT_READ, MAP_PRIVATE, fd, 4096);
+  if(p == (char*)-1 || write(1, p + FILESZ - 4096 - 1, 1) != 1)
+    fail("write from mapping");
+  if(read(fd, p, 1) >= 0)
+    fail("read into read-only mapping");
+  munmap(p, FILESZ);
+
+  // A shared mapping is seen by a forked child, and its
+  // writes reach the file.
+  p = mmap(0, FILESZ, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(p == (char*)-1)
+    fail("mmap shared");
+  if(fork() == 0){
+    p[1] = 'Y';
+    exit();
+  }
+  wait();
+  if(p[1] != 'Y' || p[0] != 'a')
+    fail("shared with child");
+  p[4096] = 'Z';
+  if(munmap(p, FILESZ) < 0)
+    fail("munmap shared");
+  close(fd);
+  fd = open("mmap_test.tmp", O_RDONLY);
+  if(read(fd, buf, FILESZ) != FILESZ || buf[1] != 'Y' || buf[4096] != 'Z')
+    fail("write back");
+  close(fd);
+
+  // Anonymous memory, shared with a child.
+  q = mmap(0, 8192, PROT_READ|PROT_WRITE, MAP_ANON|MAP_SHARED, -1, 0);
+  if(q == (char*)-1 || q[0] != 0 || q[8191] != 0)
+    fail("mmap anon");
+  if(fork() == 0){
+    q[8191] = 'c';
+    exit();
+  }
+  wait();
+  if(q[8191] != 'c')
+    fail("anon shared with child");
+  munmap(q, 8192);
+
+  unlink("mmap_test.tmp");
+  printf(1, "\nmmap_test: ok\n");
+  exit();
+}
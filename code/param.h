@@ -2,13 +2,20 @@
 #define KSTACKSIZE 4096  // size of per-process kernel stack
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NVMA         16  // mapped ranges per address space
+#define NSHM         16  // shared memory segments
+#define SHMPAGES     64  // max pages per shared memory segment
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       1000  // size of file system in blocks
+#define LOGSIZE      1024  // max data blocks in a transaction
+#define NBUF         (MAXOPBLOCKS*24)  // minimum size of disk block cache
+#define NBUFMAX      16384  // maximum size of disk block cache
+#define BCACHEFRAC   16  // disk block cache gets 1/BCACHEFRAC of free memory
+#define NREADAHEAD   32  // blocks read ahead of a sequential reader
+#define NPREALLOC    16  // free blocks kept for a file being written
+#define FLUSHTICKS  300  // ticks file data may stay dirty in the cache
+#define FSSIZE       32768  // default size of file system in blocks; see mkfs -s
+#define SWAPSIZE     65536  // size of swap area in blocks, after the file system
 
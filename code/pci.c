@@ -0,0 +1,57 @@
+// PCI configuration space, through configuration
+// mechanism #1 (I/O ports 0xCF8 and 0xCFC).
+//
+// A function is named by its configuration address,
+// bus<<16 | device<<11 | function<<8.
+
+#include "types.h"
+#include "defs.h"
+#include "x86.h"
+#include "pci.h"
+
+#define CONFADDR  0xCF8
+#define CONFDATA  0xCFC
+
+// Read the 32-bit register reg of function bdf.
+uint
+pciread(uint bdf, int reg)
+{
+  outl(CONFADDR, 0x80000000 | bdf | (reg & 0xFC));
+  return inl(CONFDATA);
+}
+
+void
+pciwrite(uint bdf, int reg, uint v)
+{
+  outl(CONFADDR, 0x80000000 | bdf | (reg & 0xFC));
+  outl(CONFDATA, v);
+}
+
+// Find the first function of the given class and subclass.
+// Returns 0 and sets *bdf, or -1 if there is none.
+int
+pcifind(int class, int subclass, uint *bdf)
+{
+  uint bus, dev, fn, a, c;
+
+  for(bus = 0; bus < 256; bus++){
+    for(dev = 0; dev < 32; dev++){
+      for(fn = 0; fn < 8; fn++){
+        a = bus<<16 | dev<<11 | fn<<8;
+        if((pciread(a, PCI_ID) & 0xFFFF) == 0xFFFF){
+          if(fn == 0)
+            break;
+          continue;
+        }
+        c = pciread(a, PCI_CLASS);
+        if((c >> 24) == class && ((c >> 16) & 0xFF) == subclass){
+          *bdf = a;
+          return 0;
+        }
+        if(fn == 0 && !(pciread(a, PCI_HDRTYPE) & PCI_MULTIFUNC))
+          break;
+      }
+    }
+  }
+  return -1;
+}
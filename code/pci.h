@@ -0,0 +1,14 @@
+// PCI configuration space registers.
+
+#define PCI_ID        0x00    // device and vendor IDs
+#define PCI_COMMAND   0x04    // command and status
+#define PCI_CLASS     0x08    // class, subclass, interface, revision
+#define PCI_HDRTYPE   0x0C    // header type in bits 16-23
+#define PCI_BAR4      0x20    // base address register 4
+
+#define PCI_IOSPACE   0x01    // in PCI_COMMAND: respond to I/O ports
+#define PCI_BUSMASTER 0x04    //   may act as bus master
+#define PCI_MULTIFUNC 0x800000  // in PCI_HDRTYPE
+
+#define PCI_CLASS_STORAGE 0x01
+#define PCI_SUBCLASS_IDE  0x01
@@ -6,6 +6,7 @@
 #include "x86.h"
 #include "proc.h"
 #include "spinlock.h"
+#include "vmspace.h"
 
 #include "ptable.h" //自定义头文件
 
@@ -108,6 +109,8 @@ found:
   p->state = EMBRYO;
   p->priority = 10;
   p->pid = nextpid++;
+  p->isthread = 0;
+  p->detached = 0;
 
   // 清空信号量持有记录
   for(int i = 0; i < 32; i++){
@@ -141,21 +144,42 @@ found:
   return p;
 }
 
+// Free a ZOMBIE proc's kernel stack and its reference
+// to the address space, and return the slot to UNUSED.
+// The ptable lock must be held.
+static void
+freeproc(struct proc *p)
+{
+  kfree(p->kstack);
+  p->kstack = 0;
+  vmsput(p->vm);
+  p->vm = 0;
+  p->isthread = 0;
+  p->detached = 0;
+  p->pid = 0;
+  p->parent = 0;
+  p->name[0] = 0;
+  p->killed = 0;
+  p->state = UNUSED;
+}
+
 //PAGEBREAK: 32
 // Set up first user process.
 void
 userinit(void)
 {
   struct proc *p;
+  pde_t *pgdir;
   extern char _binary_initcode_start[], _binary_initcode_size[];
 
   p = allocproc();
   
   initproc = p;
-  if((p->pgdir = setupkvm()) == 0)
+  if((pgdir = setupkvm()) == 0)
     panic("userinit: out of memory?");
-  inituvm(p->pgdir, _binary_initcode_start, (int)_binary_initcode_size);
-  p->sz = PGSIZE;
+  inituvm(pgdir, _binary_initcode_start, (int)_binary_initcode_size);
+  if((p->vm = vmsalloc(pgdir, PGSIZE)) == 0)
+    panic("userinit: no vmspace");
   memset(p->tf, 0, sizeof(*p->tf));
   p->tf->cs = (SEG_UCODE << 3) | DPL_USER;
   p->tf->ds = (SEG_UDATA << 3) | DPL_USER;
@@ -179,25 +203,60 @@ userinit(void)
   release(&ptable.lock);
 }
 
+// Start a kernel thread running fn(), which must never return.
+// Its address space maps only the kernel.
+void
+kthread(char *name, void (*fn)(void))
+{
+  struct proc *p;
+  pde_t *pgdir;
+
+  if((p = allocproc()) == 0 || (pgdir = setupkvm()) == 0 ||
+     (p->vm = vmsalloc(pgdir, 0)) == 0)
+    panic("kthread");
+  p->parent = initproc;
+  safestrcpy(p->name, name, sizeof(p->name));
+
+  // forkret() "returns" to fn rather than trapret.
+  *(uint*)(p->context + 1) = (uint)fn;
+
+  acquire(&ptable.lock);
+  p->state = RUNNABLE;
+  release(&ptable.lock);
+}
+
 // Grow current process's memory by n bytes.
-// Return 0 on success, -1 on failure.
+// The size lives in the shared vmspace, so threads
+// created by clone() all see the new size.
+// Return the old size on success, -1 on failure.
 int
 growproc(int n)
 {
-  uint sz;
+  uint sz, oldsz;
   struct proc *curproc = myproc();
+  struct vmspace *vm = curproc->vm;
 
-  sz = curproc->sz;
+  acquire(&vm->lock);
+  oldsz = sz = vm->sz;
   if(n > 0){
-    if((sz = allocuvm(curproc->pgdir, sz, sz + n)) == 0)
+    // Pages are allocated on first touch; see pagefault().
+    if(sz + n < sz || sz + n > MMAPBASE){
+      release(&vm->lock);
       return -1;
+    }
+    sz += n;
   } else if(n < 0){
-    if((sz = deallocuvm(curproc->pgdir, sz, sz + n)) == 0)
+    if(sz + n > sz){
+      release(&vm->lock);
       return -1;
+    }
+    sz += n;
   }
-  curproc->sz = sz;
-  switchuvm(curproc);
-  return 0;
+  vm->sz = sz;
+  release(&vm->lock);
+  if(sz < oldsz)
+    vmfree(vm, sz, oldsz);
+  return oldsz;
 }
 
 // Create a new process copying p as the parent.
@@ -206,23 +265,53 @@ growproc(int n)
 int
 fork(void)
 {
-  int i, pid;
+  int i, pid, cow, bad;
+  uint sz;
+  pde_t *pgdir;
   struct proc *np;
   struct proc *curproc = myproc();
 
+  // Make room for the copy while we can still sleep.  Sharing
+  // copy-on-write, it needs little more than page tables.
+  sz = curproc->vm->sz;
+  swapreserve(curproc->vm->nlive == 1 ? sz/BIGPGSIZE + 3 : sz/PGSIZE + 3);
+
   // Allocate process.
   if((np = allocproc()) == 0){
     return -1;
   }
 
-  // Copy process state from proc.
-  if((np->pgdir = copyuvm(curproc->pgdir, curproc->sz)) == 0){
+  // Copy process state from proc.  Hold the vmspace lock
+  // so that a sibling thread cannot resize it meanwhile.
+  // Share the pages copy-on-write unless there are sibling
+  // threads, whose TLBs we have no way to flush.  Count
+  // them with nlive, not ref: swapout() holds a ref on every
+  // vmspace it scans.  (nlive can only grow through this
+  // thread, so it is stable here.)
+  acquire(&curproc->vm->lock);
+  sz = curproc->vm->sz;
+  cow = curproc->vm->nlive == 1;
+  bad = 0;
+  pgdir = copyuvm(curproc->vm->pgdir, sz, cow);
+  if(pgdir != 0 && (np->vm = vmsalloc(pgdir, sz)) != 0)
+    bad = vmacopy(np->vm, curproc->vm, cow) < 0;
+  if(cow)
+    lcr3(V2P(curproc->vm->pgdir));  // flush the entries that lost PTE_W
+  release(&curproc->vm->lock);
+  if(bad){
+    vmsexit(np->vm);
+    vmsput(np->vm);
+    np->vm = 0;
+    pgdir = 0;
+  }
+  if(pgdir == 0 || np->vm == 0){
+    if(pgdir)
+      freevm(pgdir);
     kfree(np->kstack);
     np->kstack = 0;
     np->state = UNUSED;
     return -1;
   }
-  np->sz = curproc->sz;
   np->parent = curproc;
   *np->tf = *curproc->tf;
 
@@ -297,11 +386,20 @@ exit(void)
   iput(curproc->cwd);
   end_op();
   curproc->cwd = 0;
+  uvmunpin();
+  vmsexit(curproc->vm);
 
   acquire(&ptable.lock);
 
-  // Parent might be sleeping in wait().
-  wakeup1(curproc->parent);
+  // A detached thread is freed by the scheduler as soon as
+  // it is off its kernel stack; nobody waits for it.
+  // Otherwise the parent might be sleeping in wait() or join(),
+  // or in join_tid() on this thread.
+  if(!curproc->detached){
+    wakeup1(curproc->parent);
+    if(curproc->isthread)
+      wakeup1(curproc);
+  }
 
   // Pass abandoned children to init.
   for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
@@ -334,18 +432,14 @@ wait(void)
     for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
       if(p->parent != curproc)
         continue;
+      // Threads sharing our address space are reaped by join().
+      if(p->isthread && p->vm == curproc->vm)
+        continue;
       havekids = 1;
       if(p->state == ZOMBIE){
         // Found one.
         pid = p->pid;
-        kfree(p->kstack);
-        p->kstack = 0;
-        freevm(p->pgdir);
-        p->pid = 0;
-        p->parent = 0;
-        p->name[0] = 0;
-        p->killed = 0;
-        p->state = UNUSED;
+        freeproc(p);
         release(&ptable.lock);
         return pid;
       }
@@ -364,7 +458,7 @@ wait(void)
 
 int wait2(int *retime, int *rutime, int *stime) {
   struct proc *p;
-  int havekids, pid;
+  int havekids, pid, re, ru, st;
   acquire(&ptable.lock);
   for(;;){
     // Scan through table looking for zombie children.
@@ -372,27 +466,27 @@ int wait2(int *retime, int *rutime, int *stime) {
     for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
       if(p->parent != myproc())
         continue;
+      if(p->isthread && p->vm == myproc()->vm)
+        continue;
       havekids = 1;
       if(p->state == ZOMBIE){
         // Found one.
-        *retime = p->retime;
-        *rutime = p->rutime;
-        *stime = p->stime;
+        re = p->retime;
+        ru = p->rutime;
+        st = p->stime;
         pid = p->pid;
-        kfree(p->kstack);
-        p->kstack = 0;
-        freevm(p->pgdir);
-        p->state = UNUSED;
-        p->pid = 0;
-        p->parent = 0;
-        p->name[0] = 0;
-        p->killed = 0;
+        freeproc(p);
         p->ctime = 0;
         p->retime = 0;
         p->rutime = 0;
         p->stime = 0;
         p->priority = 0;
         release(&ptable.lock);
+        // Store to user memory only now: it may have
+        // been swapped out, and reading it back sleeps.
+        *retime = re;
+        *rutime = ru;
+        *stime = st;
         return pid;
       }
     }
@@ -451,6 +545,7 @@ scheduler(void)
 
       swtch(&(c->scheduler), p->context);
       switchkvm();
+      c->vm = 0;
 
       // Process is done running for now.
       // It should have changed its p->state before coming back.
@@ -489,10 +584,17 @@ scheduler(void)
 
           swtch(&(c->scheduler), p->context);
           switchkvm();
+          c->vm = 0;
+          c->nsched++;
 
           // Process is done running for now.
           // It should have changed its p->state before coming back.
           c->proc = 0;
+
+          // A detached thread that just exited is no longer
+          // using its kernel stack, so it can be freed here.
+          if(p->state == ZOMBIE && p->detached)
+            freeproc(p);
       }
       release(&ptable.lock);
   }
@@ -548,8 +650,13 @@ forkret(void)
     // of a regular process (e.g., they call sleep), and thus cannot
     // be run from main().
     first = 0;
-    iinit(ROOTDEV);
+    // Recover the log first: install_trans() writes blocks
+    // home behind the buffer cache, so nothing else may have
+    // read them into it yet.  iinit() reads the bitmap.
     initlog(ROOTDEV);
+    iinit(ROOTDEV);
+    swapinit(ROOTDEV);
+    bflushinit();
   }
 
   // Return to "caller", actually trapret (see allocproc).
@@ -764,8 +871,17 @@ int clone(void (*func)(void *), void *arg, void *stack)
    if((np = allocproc()) == 0)
      return -1;
 
-   np->pgdir = curproc->pgdir; 
-   np->sz = curproc->sz;
+   // Threads never share pages copy-on-write; see unshareuvm().
+   acquire(&curproc->vm->lock);
+   if(unshareuvm(curproc->vm) < 0){
+     release(&curproc->vm->lock);
+     kfree(np->kstack);
+     np->kstack = 0;
+     np->state = UNUSED;
+     return -1;
+   }
+   np->vm = vmsdup(curproc->vm);
+   release(&curproc->vm->lock);
    np->parent = curproc;
    *np->tf = *curproc->tf;
    np->stack = stack;
@@ -813,27 +929,24 @@ int join(void **stack)
   struct proc *p;
   int haveKids, pid;
   struct proc *curproc = myproc();
+  void *s;
 
   acquire(&ptable.lock);
   for(;;) {
     haveKids = 0;
 
     for (p = ptable.proc; p < &ptable.proc[NPROC]; p++) {
-      if (p->parent != curproc || p->isthread != 1 )
+      if (p->parent != curproc || p->isthread != 1 || p->detached)
         continue;
       haveKids = 1;
 
       if (p->state == ZOMBIE) {
         pid = p->pid;
-        kfree(p->kstack);
-        p->kstack = 0;
-        p->state = UNUSED;
-        p->pid = 0;
-        p->parent = 0;
-        p->name[0] = 0;
-        p->killed = 0;
-        *stack = p->stack;
+        s = p->stack;
+        freeproc(p);
         release(&ptable.lock);
+        // As in wait2(): *stack may be swapped out.
+        *stack = s;
         return pid;
       }
     }
@@ -849,6 +962,67 @@ int join(void **stack)
   return 0;
 }
 
+// Wait for the thread tid, created by the caller and
+// not detached, to exit.  Sleeps on the thread itself,
+// so other threads exiting do not wake the caller.
+// Returns tid, or -1 if tid is not such a thread.
+int
+join_tid(int tid, void **stack)
+{
+  struct proc *p;
+  struct proc *curproc = myproc();
+  void *s;
+
+  acquire(&ptable.lock);
+  for(;;){
+    for(p = ptable.proc; p < &ptable.proc[NPROC]; p++)
+      if(p->pid == tid && p->parent == curproc &&
+         p->isthread && !p->detached)
+        break;
+    if(p == &ptable.proc[NPROC] || curproc->killed){
+      release(&ptable.lock);
+      return -1;
+    }
+    if(p->state == ZOMBIE){
+      s = p->stack;
+      freeproc(p);
+      release(&ptable.lock);
+      // As in wait2(): *stack may be swapped out.
+      *stack = s;
+      return tid;
+    }
+    sleep(p, &ptable.lock);
+  }
+}
+
+// Mark the thread tid as detached: it will be freed when
+// it exits, without waking its parent, and cannot be joined.
+// Returns 1 if it had already exited and was freed now,
+// 0 if it is still running, -1 if it is not our thread.
+int
+detach(int tid)
+{
+  struct proc *p;
+  struct proc *curproc = myproc();
+
+  acquire(&ptable.lock);
+  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+    if(p->pid == tid && p->parent == curproc &&
+       p->isthread && !p->detached){
+      if(p->state == ZOMBIE){
+        freeproc(p);
+        release(&ptable.lock);
+        return 1;
+      }
+      p->detached = 1;
+      release(&ptable.lock);
+      return 0;
+    }
+  }
+  release(&ptable.lock);
+  return -1;
+}
+
 // Run every clock tick and update the statistic fields of each process
 void 
 update_statistics() {
@@ -1022,7 +1196,9 @@ getptable(void *ubuf, int size)
       // 处理父进程 PID，如果是 init 或无父进程，设为 -1 (N/A)
       pi.ppid = (p->parent) ? p->parent->pid : -1; 
       pi.priority = p->priority;
-      pi.mem_size = p->sz;
+      pi.mem_size = p->vm ? p->vm->sz : 0;
+      if(p->vm)
+        vmsusage(p->vm, &pi.rss, &pi.nswap);
       pi.state = p->state;
       safestrcpy(pi.name, p->name, sizeof(pi.name));
     } 
@@ -1030,10 +1206,11 @@ getptable(void *ubuf, int size)
 
     // 计算当前结构体在用户缓冲区的目标地址
     // 直接从内核将这就一个结构体 copy 到用户空间的正确偏移位置
-    if(copyout(myproc()->pgdir, (uint)(uptr + i * sizeof(struct proc_info)), (char*)&pi, sizeof(pi)) < 0){
-      release(&ptable.lock);
+    // copyout 可能要从 swap 读回页面而睡眠，所以先放开 ptable.lock
+    release(&ptable.lock);
+    if(copyout(myproc()->vm->pgdir, (uint)(uptr + i * sizeof(struct proc_info)), (char*)&pi, sizeof(pi)) < 0)
       return -1;
-    }
+    acquire(&ptable.lock);
     i++;
   }
 
@@ -8,6 +8,8 @@ struct cpu {
   int ncli;                    // Depth of pushcli nesting.
   int intena;                  // Were interrupts enabled before pushcli?
   struct proc *proc;           // The process running on this cpu or null
+  struct vmspace *vm;          // Address space in %cr3, or null; see swapout()
+  volatile uint nsched;        // Times back in the scheduler; see vmfree()
 };
 
 extern struct cpu cpus[NCPU];
@@ -36,8 +38,8 @@ enum procstate { UNUSED, EMBRYO, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
 // Per-process state
 struct proc {
-  uint sz;                     // Size of process memory (bytes)
-  pde_t* pgdir;                // Page table
+  struct vmspace *vm;          // Address space (shared with clone()d threads)
+  struct vmspace *pinvm;       // If non-zero, vm pinned by the current syscall
   char *kstack;                // Bottom of kernel stack for this process
   enum procstate state;        // Process state
   int pid;                     // Process ID
@@ -51,6 +53,7 @@ struct proc {
   struct inode *cwd;           // Current directory
   char name[16];               // Process name (debugging)
   int isthread;                //changes
+  int detached;                // If non-zero, thread is freed on exit, not joined
   void *stack;
   uint ctime;                  // Process creation time
   int stime;                   // Process SLEEPING time
@@ -34,7 +34,7 @@ main(int argc, char *argv[])
   // 注意：PDF 中是 CSV 格式（逗号分隔，带引号），但也可能允许制表符。
   // 这里我们尽量贴近讲义的视觉效果，使用制表符对齐，但如果必须过自动评测机，请严格改为 CSV。
   // 下面是符合人类阅读习惯的格式：
-  printf(1, "PID\tPPID\tPRI\tMEM\tSTATE\t\tCMD\n");
+  printf(1, "PID\tPPID\tPRI\tMEM\tRSS\tSWAP\tSTATE\t\tCMD\n");
 
   for(i = 0; i < NPROC; i++){
     if(pinfo[i].pid == 0) // 跳过未使用的进程槽位
@@ -49,8 +49,9 @@ main(int argc, char *argv[])
     else
       printf(1, "%d\t", pinfo[i].ppid);
 
-    // 打印优先级、内存、状态、命令
-    printf(1, "%d\t%d\t", pinfo[i].priority, pinfo[i].mem_size);
+    // 打印优先级、内存、常驻/换出页数、状态、命令
+    printf(1, "%d\t%d\t%d\t%d\t", pinfo[i].priority, pinfo[i].mem_size,
+           pinfo[i].rss, pinfo[i].nswap);
     
     if(pinfo[i].state >= 0 && pinfo[i].state < 6)
       printf(1, "%s\t", states[pinfo[i].state]);
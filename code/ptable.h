@@ -9,6 +9,8 @@ struct proc_info {
   int ppid;
   int priority;
   int mem_size;
+  int rss;          // resident pages
+  int nswap;        // pages out in swap
   enum procstate state;
   char name[16];
 };
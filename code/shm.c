@@ -0,0 +1,150 @@
+// Named shared memory segments.
+//
+// shmget(key, size) finds or creates the segment called key,
+// shmat(id) maps it into the calling process, shmdt(addr)
+// unmaps it again and shmrm(id) frees it once nobody has it
+// attached.  Attachments are ranges (struct vma) of the
+// vmspace, so they are inherited by fork() and dropped by
+// exit() and exec() like other mappings.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "shm.h"
+
+struct {
+  struct spinlock lock;
+  struct shmseg seg[NSHM];
+} shmtable;
+
+void
+shminit(void)
+{
+  initlock(&shmtable.lock, "shm");
+}
+
+// Free the pages of s.  Caller holds shmtable.lock.
+static void
+shmfree(struct shmseg *s)
+{
+  int i;
+
+  for(i = 0; i < s->npages; i++)
+    kfree(s->pages[i]);
+  s->npages = 0;
+}
+
+// Return the id of the segment called key, creating it with
+// size bytes of zeroed memory if there is none.  Fails if
+// the segment exists but is smaller than size.
+int
+shmget(int key, int size)
+{
+  struct shmseg *s, *free;
+  int n;
+
+  n = PGROUNDUP(size) / PGSIZE;
+  if(size <= 0 || n > SHMPAGES)
+    return -1;
+
+  acquire(&shmtable.lock);
+  free = 0;
+  for(s = shmtable.seg; s < &shmtable.seg[NSHM]; s++){
+    if(s->npages == 0){
+      if(free == 0)
+        free = s;
+    } else if(s->key == key && !s->removed){
+      release(&shmtable.lock);
+      return n > s->npages ? -1 : s - shmtable.seg;
+    }
+  }
+  if((s = free) == 0){
+    release(&shmtable.lock);
+    return -1;
+  }
+  for(s->npages = 0; s->npages < n; s->npages++){
+    if((s->pages[s->npages] = kalloc()) == 0){
+      shmfree(s);
+      release(&shmtable.lock);
+      return -1;
+    }
+    memset(s->pages[s->npages], 0, PGSIZE);
+  }
+  s->key = key;
+  s->ref = 0;
+  s->removed = 0;
+  release(&shmtable.lock);
+  return s - shmtable.seg;
+}
+
+// Map segment id into the current process.
+// Returns its address, or -1.
+int
+shmat(int id)
+{
+  struct shmseg *s;
+  uint a;
+
+  if(id < 0 || id >= NSHM)
+    return -1;
+  s = &shmtable.seg[id];
+  acquire(&shmtable.lock);
+  if(s->npages == 0 || s->removed){
+    release(&shmtable.lock);
+    return -1;
+  }
+  s->ref++;
+  release(&shmtable.lock);
+
+  if((a = vmamappages(s->pages, s->npages, PTE_W|PTE_U, s)) == 0){
+    shmput(s);
+    return -1;
+  }
+  return a;
+}
+
+// Mark segment id to be freed once it is not attached.
+int
+shmrm(int id)
+{
+  struct shmseg *s;
+
+  if(id < 0 || id >= NSHM)
+    return -1;
+  s = &shmtable.seg[id];
+  acquire(&shmtable.lock);
+  if(s->npages == 0 || s->removed){
+    release(&shmtable.lock);
+    return -1;
+  }
+  s->removed = 1;
+  if(s->ref == 0)
+    shmfree(s);
+  release(&shmtable.lock);
+  return 0;
+}
+
+// Count another attachment of s, for fork().
+void
+shmdup(struct shmseg *s)
+{
+  acquire(&shmtable.lock);
+  if(s->ref < 1)
+    panic("shmdup");
+  s->ref++;
+  release(&shmtable.lock);
+}
+
+// Drop an attachment of s.
+void
+shmput(struct shmseg *s)
+{
+  acquire(&shmtable.lock);
+  if(s->ref < 1)
+    panic("shmput");
+  if(--s->ref == 0 && s->removed)
+    shmfree(s);
+  release(&shmtable.lock);
+}
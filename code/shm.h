@@ -0,0 +1,10 @@
+// Shared memory segment.  Its pages are mapped into every
+// address space that attaches it (see vmamappages()), each
+// mapping holding a page reference; the segment holds one more.
+struct shmseg {
+  int key;
+  int ref;              // attachments, counting fork()ed copies
+  int removed;          // shmrm() was called: free at last detach
+  int npages;           // 0 if this slot is free
+  char *pages[SHMPAGES];
+};
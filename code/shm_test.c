@@ -0,0 +1,74 @@
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+
+#define KEY    1234
+#define NSLOT  16
+#define N      1000
+#define EMPTY  10   // semaphore ids
+#define FULL   11
+
+struct ring {
+  int slot[NSLOT];
+};
+
+// A producer and a consumer pass N integers through a
+// shared memory ring buffer, synchronized by semaphores.
+int
+main(int argc, char *argv[])
+{
+  struct ring *r;
+  int id, i, sum;
+
+  if(sem_init(EMPTY, NSLOT) < 0 || sem_init(FULL, 0) < 0){
+    printf(1, "shm_test: sem_init FAILED\n");
+    exit();
+  }
+  if((id = shmget(KEY, sizeof(struct ring))) < 0){
+    printf(1, "shm_test: shmget FAILED\n");
+    exit();
+  }
+  if(shmget(KEY, 2*4096) >= 0){
+    printf(1, "shm_test: shmget of a bigger segment FAILED\n");
+    exit();
+  }
+
+  if(fork() == 0){
+    // Attach by name rather than through fork().
+    if((r = shmat(shmget(KEY, sizeof(struct ring)))) == (void*)-1){
+      printf(1, "shm_test: child shmat FAILED\n");
+      exit();
+    }
+    for(i = 1; i <= N; i++){
+      sem_wait(EMPTY, 1);
+      r->slot[i % NSLOT] = i;
+      sem_signal(FULL, 1);
+    }
+    shmdt(r);
+    exit();
+  }
+
+  if((r = shmat(id)) == (void*)-1){
+    printf(1, "shm_test: shmat FAILED\n");
+    exit();
+  }
+  sum = 0;
+  for(i = 1; i <= N; i++){
+    sem_wait(FULL, 1);
+    sum += r->slot[i % NSLOT];
+    sem_signal(EMPTY, 1);
+  }
+  wait();
+  if(shmdt(r) < 0 || shmrm(id) < 0 || shmat(id) != (void*)-1){
+    printf(1, "shm_test: shmdt/shmrm FAILED\n");
+    exit();
+  }
+  sem_destroy(EMPTY);
+  sem_destroy(FULL);
+  if(sum != N*(N+1)/2){
+    printf(1, "shm_test: FAILED, sum %d\n", sum);
+    exit();
+  }
+  printf(1, "shm_test: ok\n");
+  exit();
+}
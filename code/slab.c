@@ -0,0 +1,172 @@
+// Slab allocator for kernel objects smaller than a page.
+//
+// A slabcache hands out objects of one size.  It carves
+// pages from kalloc() into slabs: a small header at the
+// start of the page followed by as many objects as fit.
+// Free objects in a slab are linked through their first
+// word, and an object finds its slab by rounding its
+// address down to the page.
+//
+// Each CPU keeps a magazine of up to MAGSIZE free objects,
+// so most slaballoc() and slabfree() calls do not touch
+// the cache's lock.  An empty magazine is refilled, and a
+// full one drained, half a magazine at a time.
+// A slab whose objects are all free goes back to kalloc(),
+// unless it is the cache's only partial slab.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "slab.h"
+
+struct slab {
+  struct slab *next;   // partial list
+  struct slab *prev;
+  int nfree;
+  void *freelist;
+};
+
+// Object offset within a slab page; keeps objects 8-byte aligned.
+#define SLABHDR  ((sizeof(struct slab) + 7) & ~7)
+
+void
+slabinit(struct slabcache *c, char *name, uint size)
+{
+  initlock(&c->lock, name);
+  c->name = name;
+  c->size = (size + 7) & ~7;
+  c->perslab = (PGSIZE - SLABHDR) / c->size;
+  if(c->perslab == 0)
+    panic("slabinit: object too big");
+  c->partial = 0;
+  c->nslab = 0;
+  c->nout = 0;
+  memset(c->mag, 0, sizeof(c->mag));
+}
+
+static void
+rmpartial(struct slabcache *c, struct slab *s)
+{
+  if(s->prev)
+    s->prev->next = s->next;
+  else
+    c->partial = s->next;
+  if(s->next)
+    s->next->prev = s->prev;
+}
+
+static void
+pushpartial(struct slabcache *c, struct slab *s)
+{
+  s->prev = 0;
+  s->next = c->partial;
+  if(c->partial)
+    c->partial->prev = s;
+  c->partial = s;
+}
+
+// Take one object out of the slabs, growing the
+// cache by a page if none is free.
+// Caller must hold c->lock.
+static void*
+slabget(struct slabcache *c)
+{
+  struct slab *s;
+  char *obj;
+  uint i;
+
+  if((s = c->partial) == 0){
+    if((s = (struct slab*)kalloc()) == 0)
+      return 0;
+    s->freelist = 0;
+    for(i = c->perslab; i > 0; i--){
+      obj = (char*)s + SLABHDR + (i-1)*c->size;
+      *(void**)obj = s->freelist;
+      s->freelist = obj;
+    }
+    s->nfree = c->perslab;
+    pushpartial(c, s);
+    c->nslab++;
+  }
+  obj = s->freelist;
+  s->freelist = *(void**)obj;
+  if(--s->nfree == 0)
+    rmpartial(c, s);
+  c->nout++;
+  return obj;
+}
+
+// Return obj to its slab.
+// Caller must hold c->lock.
+static void
+slabput(struct slabcache *c, void *obj)
+{
+  struct slab *s;
+
+  s = (struct slab*)PGROUNDDOWN((uint)obj);
+  *(void**)obj = s->freelist;
+  s->freelist = obj;
+  c->nout--;
+  if(++s->nfree == 1)
+    pushpartial(c, s);
+  if(s->nfree == c->perslab && (s->next || s->prev)){
+    rmpartial(c, s);
+    c->nslab--;
+    kfree((char*)s);
+  }
+}
+
+// Allocate an object from c.
+// Returns 0 if the memory cannot be allocated.
+void*
+slaballoc(struct slabcache *c)
+{
+  struct magazine *m;
+  void *obj;
+
+  pushcli();
+  m = &c->mag[cpuid()];
+  if(m->n == 0){
+    acquire(&c->lock);
+    while(m->n < MAGSIZE/2 && (obj = slabget(c)) != 0)
+      m->obj[m->n++] = obj;
+    release(&c->lock);
+  }
+  obj = m->n > 0 ? m->obj[--m->n] : 0;
+  popcli();
+  return obj;
+}
+
+// Free an object allocated from c.
+void
+slabfree(struct slabcache *c, void *obj)
+{
+  struct magazine *m;
+
+  pushcli();
+  m = &c->mag[cpuid()];
+  if(m->n == MAGSIZE){
+    acquire(&c->lock);
+    while(m->n > MAGSIZE/2)
+      slabput(c, m->obj[--m->n]);
+    release(&c->lock);
+  }
+  m->obj[m->n++] = obj;
+  popcli();
+}
+
+// Report how many objects of c are in use and
+// how many pages c holds.  A snapshot, read without locks.
+void
+slabstat(struct slabcache *c, int *nobj, int *npages)
+{
+  int i, n;
+
+  n = c->nout;
+  for(i = 0; i < NCPU; i++)
+    n -= c->mag[i].n;
+  *nobj = n;
+  *npages = c->nslab;
+}
@@ -0,0 +1,21 @@
+// Object caches for kernel structures smaller than a page.
+
+#define MAGSIZE 8   // objects per per-CPU magazine
+
+// A CPU's stack of recently freed objects.  Only that
+// CPU uses it, with interrupts off, so it needs no lock.
+struct magazine {
+  int n;
+  void *obj[MAGSIZE];
+};
+
+struct slabcache {
+  struct spinlock lock; // protects everything below except mag
+  char *name;
+  uint size;            // object size in bytes
+  uint perslab;         // objects per slab page
+  struct slab *partial; // slabs with some free objects
+  int nslab;            // pages held by this cache
+  int nout;             // objects taken out of slabs
+  struct magazine mag[NCPU];
+};
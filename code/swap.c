@@ -0,0 +1,156 @@
+// Swap space.
+//
+// mkfs reserves a range of blocks after the file system
+// (sb.swapstart, sb.nswap) where swapout() in vm.c puts user
+// pages when memory runs low.  Each slot holds one page; an
+// evicted page's PTE records its slot (see PTE_SWAP), and
+// fork() lets the child share the slot until either process
+// reads it back in.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "buf.h"
+
+#define SPP    (PGSIZE/BSIZE)   // blocks per slot
+#define NSLOT  (SWAPSIZE/SPP)
+
+struct {
+  struct spinlock lock;
+  uint dev;
+  uint start;           // first block of the swap area
+  uint nslot;           // slots on dev, at most NSLOT
+  uint next;            // where swapalloc() starts looking
+  uchar ref[NSLOT];     // page table entries holding each slot
+  uchar busy[NSLOT];    // still being written; see swapread()
+  struct buf buf[SPP];  // for swap I/O, one per block of a slot
+} swap;
+
+// Find the swap area of dev.  Called from forkret(),
+// since reading the super block may sleep.
+void
+swapinit(int dev)
+{
+  struct superblock sb;
+  int i;
+
+  initlock(&swap.lock, "swap");
+  for(i = 0; i < SPP; i++)
+    initsleeplock(&swap.buf[i].lock, "swapbuf");
+  readsb(dev, &sb);
+  swap.dev = dev;
+  swap.start = sb.swapstart;
+  swap.nslot = sb.nswap / SPP;
+  if(swap.nslot > NSLOT)
+    swap.nslot = NSLOT;
+  cprintf("swap: %d pages at block %d\n", swap.nslot, swap.start);
+}
+
+// Allocate a slot for a page that is about to be written
+// out with swapwrite().  Returns -1 if swap is full.
+int
+swapalloc(void)
+{
+  uint i, s;
+
+  acquire(&swap.lock);
+  for(i = 0; i < swap.nslot; i++){
+    s = (swap.next + i) % swap.nslot;
+    if(swap.ref[s] == 0 && !swap.busy[s]){
+      swap.ref[s] = 1;
+      swap.busy[s] = 1;
+      swap.next = s + 1;
+      release(&swap.lock);
+      return s;
+    }
+  }
+  release(&swap.lock);
+  return -1;
+}
+
+// Report the number of swap slots and how many are in use.
+void
+swapstat(uint *nslot, uint *nused)
+{
+  uint s, n;
+
+  n = 0;
+  acquire(&swap.lock);
+  for(s = 0; s < swap.nslot; s++)
+    if(swap.ref[s] || swap.busy[s])
+      n++;
+  release(&swap.lock);
+  *nslot = swap.nslot;
+  *nused = n;
+}
+
+// Add a reference to slot s, for fork().
+void
+swapdup(uint s)
+{
+  acquire(&swap.lock);
+  if(s >= swap.nslot || swap.ref[s] < 1)
+    panic("swapdup");
+  swap.ref[s]++;
+  release(&swap.lock);
+}
+
+// Drop a reference to slot s.
+void
+swapfree(uint s)
+{
+  acquire(&swap.lock);
+  if(s >= swap.nslot || swap.ref[s] < 1)
+    panic("swapfree");
+  swap.ref[s]--;
+  release(&swap.lock);
+}
+
+// Move a page between mem and slot s with one disk command,
+// pointing the bufs straight at the page.
+static void
+swaprw(uint s, char *mem, int write)
+{
+  struct buf *b[SPP];
+  int i;
+
+  for(i = 0; i < SPP; i++){
+    b[i] = &swap.buf[i];
+    acquiresleep(&b[i]->lock);
+    b[i]->dev = swap.dev;
+    b[i]->blockno = swap.start + s*SPP + i;
+    b[i]->data = (uchar*)mem + i*BSIZE;
+    b[i]->flags = write ? B_DIRTY : 0;
+  }
+  iderwv(b, SPP);
+  for(i = 0; i < SPP; i++)
+    releasesleep(&b[i]->lock);
+}
+
+// Write the page at mem to slot s, which swapalloc()
+// has just returned.
+void
+swapwrite(uint s, char *mem)
+{
+  swaprw(s, mem, 1);
+  acquire(&swap.lock);
+  swap.busy[s] = 0;
+  wakeup(&swap.busy[s]);
+  release(&swap.lock);
+}
+
+// Read slot s into the page at mem, waiting first
+// for the page to finish going out.
+void
+swapread(uint s, char *mem)
+{
+  acquire(&swap.lock);
+  while(swap.busy[s])
+    sleep(&swap.busy[s], &swap.lock);
+  release(&swap.lock);
+  swaprw(s, mem, 0);
+}
@@ -0,0 +1,80 @@
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+
+// More than the 224 MB of physical memory (PHYSTOP),
+// but less than that plus the swap area.
+#define NPAGE   60000
+#define PGSIZE  4096
+
+// Pages kept for the fork.  Pages shared copy-on-write are
+// never swapped out (see evict() in vm.c), so the child's
+// copies need memory that the parent has given back.
+#define NFORK   40000
+
+static int
+check(char *p, int from, int to, int step)
+{
+  int i;
+
+  for(i = from; i < to; i += step)
+    if(*(int*)(p + i*PGSIZE) != i)
+      return -1;
+  return 0;
+}
+
+// Touching more memory than the machine has pushes
+// idle pages out to swap; they come back on access,
+// in the process and in a child that forked from it.
+int
+main(int argc, char *argv[])
+{
+  char *p, ok;
+  int i, pid, fd[2];
+
+  if((p = sbrk(NPAGE*PGSIZE)) == (char*)-1){
+    printf(1, "swap_test: sbrk FAILED\n");
+    exit();
+  }
+  for(i = 0; i < NPAGE; i++)
+    *(int*)(p + i*PGSIZE) = i;
+  if(check(p, 0, NPAGE, 1) < 0){
+    printf(1, "swap_test: read back FAILED\n");
+    exit();
+  }
+  printf(1, "swap_test: overcommit ok\n");
+
+  sbrk(-(NPAGE-NFORK)*PGSIZE);
+  if(pipe(fd) < 0){
+    printf(1, "swap_test: pipe FAILED\n");
+    exit();
+  }
+  if((pid = fork()) == 0){
+    // Report through the pipe; a child killed for want
+    // of memory writes nothing.
+    close(fd[0]);
+    ok = check(p, 0, NFORK, 7) < 0 ? 'n' : 'y';
+    for(i = 0; i < NFORK; i += 7)
+      *(int*)(p + i*PGSIZE) = -1;
+    write(fd[1], &ok, 1);
+    exit();
+  }
+  if(pid < 0){
+    printf(1, "swap_test: fork FAILED\n");
+    exit();
+  }
+  close(fd[1]);
+  if(read(fd[0], &ok, 1) != 1 || ok != 'y'){
+    printf(1, "swap_test: child FAILED\n");
+    exit();
+  }
+  close(fd[0]);
+  wait();
+  if(check(p, 0, NFORK, 1) < 0){
+    printf(1, "swap_test: parent after fork FAILED\n");
+    exit();
+  }
+  sbrk(-NFORK*PGSIZE);
+  printf(1, "swap_test: ok\n");
+  exit();
+}
@@ -0,0 +1,98 @@
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "fcntl.h"
+#include "fs.h"
+#include "meminfo.h"
+
+#define N 100
+
+// Buffers waiting to be written back.
+static uint
+nwb(void)
+{
+  struct meminfo mi;
+
+  if(meminfo(&mi) < 0){
+    printf(1, "sync_test: meminfo FAILED\n");
+    exit();
+  }
+  return mi.nbwb;
+}
+
+// Rewrite a small file many times, as a counter would, then
+// push it to disk with fsync() and sync() and read it back.
+// Then check that an overwrite waits in the cache, and that
+// fsync() and sync() write it back.
+int
+main(int argc, char *argv[])
+{
+  int fd, i, v, t0;
+  uint n;
+  char buf[BSIZE];
+
+  if((fd = open("sync_test.tmp", O_CREATE|O_RDWR)) < 0){
+    printf(1, "sync_test: open FAILED\n");
+    exit();
+  }
+  t0 = uptime();
+  for(i = 0; i < N; i++){
+    close(fd);
+    fd = open("sync_test.tmp", O_RDWR);
+    if(write(fd, &i, sizeof(i)) != sizeof(i)){
+      printf(1, "sync_test: write FAILED\n");
+      exit();
+    }
+  }
+  printf(1, "sync_test: %d rewrites in %d ticks\n", N, uptime() - t0);
+
+  if(fsync(fd) < 0 || fsync(-1) >= 0){
+    printf(1, "sync_test: fsync FAILED\n");
+    exit();
+  }
+  close(fd);
+  sync();
+
+  fd = open("sync_test.tmp", O_RDONLY);
+  if(read(fd, &v, sizeof(v)) != sizeof(v) || v != N-1){
+    printf(1, "sync_test: read back FAILED\n");
+    exit();
+  }
+  close(fd);
+
+  // The block is on disk and out of the log now, so an
+  // overwrite is only marked dirty.  Try again in case the
+  // flusher ran in between.
+  memset(buf, 'x', sizeof(buf));
+  fd = open("sync_test.tmp", O_RDWR);
+  for(i = 0; i < 3; i++){
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf(1, "sync_test: overwrite FAILED\n");
+      exit();
+    }
+    if((n = nwb()) > 0)
+      break;
+    close(fd);
+    sync();
+    fd = open("sync_test.tmp", O_RDWR);
+  }
+  if(n == 0 || fsync(fd) < 0 || nwb() >= n){
+    printf(1, "sync_test: fsync write-back FAILED\n");
+    exit();
+  }
+  close(fd);
+  fd = open("sync_test.tmp", O_RDWR);
+  if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+    printf(1, "sync_test: overwrite FAILED\n");
+    exit();
+  }
+  close(fd);
+  sync();
+  if(nwb() != 0){
+    printf(1, "sync_test: sync write-back FAILED\n");
+    exit();
+  }
+  unlink("sync_test.tmp");
+  printf(1, "sync_test: ok\n");
+  exit();
+}
@@ -18,9 +18,9 @@
 int
 fetchint(uint addr, int *ip)
 {
-  struct proc *curproc = myproc();
-
-  if(addr >= curproc->sz || addr+4 > curproc->sz)
+  if(addr+4 < addr || addr+4 > uvmlimit(addr))
+    return -1;
+  if(uvmprefault(addr, 4, 0) < 0)
     return -1;
   *ip = *(int*)(addr);
   return 0;
@@ -33,13 +33,14 @@ int
 fetchstr(uint addr, char **pp)
 {
   char *s, *ep;
-  struct proc *curproc = myproc();
 
-  if(addr >= curproc->sz)
+  if((ep = (char*)uvmlimit(addr)) == 0)
     return -1;
+  uvmpin();
   *pp = (char*)addr;
-  ep = (char*)curproc->sz;
   for(s = *pp; s < ep; s++){
+    if((s == *pp || (uint)s % PGSIZE == 0) && uvmprefault((uint)s, 1, 0) < 0)
+      return -1;
     if(*s == 0)
       return s - *pp;
   }
@@ -53,23 +54,42 @@ argint(int n, int *ip)
   return fetchint((myproc()->tf->esp) + 4 + 4*n, ip);
 }
 
-// Fetch the nth word-sized system call argument as a pointer
-// to a block of memory of size bytes.  Check that the pointer
-// lies within the process address space.
-int
-argptr(int n, char **pp, int size)
+static int
+fetchptr(int n, char **pp, int size, int write)
 {
   int i;
-  struct proc *curproc = myproc();
- 
+
   if(argint(n, &i) < 0)
     return -1;
-  if(size < 0 || (uint)i >= curproc->sz || (uint)i+size > curproc->sz)
+  if(size < 0 || (uint)i+size < (uint)i || (uint)i+size > uvmlimit(i))
+    return -1;
+  uvmpin();
+  if(uvmprefault(i, size, write) < 0)
     return -1;
   *pp = (char*)i;
   return 0;
 }
 
+// Fetch the nth word-sized system call argument as a pointer
+// to a block of memory of size bytes, which the kernel may
+// write to.  Check that the pointer lies within the process
+// address space and is writable, and read in any of it that
+// is still on disk (see uvmprefault).  It stays in memory
+// until the system call returns (see uvmpin).
+int
+argptr(int n, char **pp, int size)
+{
+  return fetchptr(n, pp, size, 1);
+}
+
+// Like argptr, for a block the kernel only reads,
+// which may lie in a read-only mapping.
+int
+argrdptr(int n, char **pp, int size)
+{
+  return fetchptr(n, pp, size, 0);
+}
+
 // Fetch the nth word-sized system call argument as a string pointer.
 // Check that the pointer is valid and the string is nul-terminated.
 // (There is no shared writable memory, so the string can't change
@@ -117,6 +137,17 @@ extern int sys_getscheduler(void);
 extern int sys_setscheduler(void);
 extern int sys_wait2(void);
 extern int sys_yield(void);
+extern int sys_join_tid(void);
+extern int sys_detach(void);
+extern int sys_mmap(void);
+extern int sys_munmap(void);
+extern int sys_shmget(void);
+extern int sys_shmat(void);
+extern int sys_shmdt(void);
+extern int sys_shmrm(void);
+extern int sys_meminfo(void);
+extern int sys_fsync(void);
+extern int sys_sync(void);
 
 static int (*syscalls[])(void) = {
 [SYS_fork]    sys_fork,
@@ -153,6 +184,17 @@ static int (*syscalls[])(void) = {
 [SYS_setscheduler] sys_setscheduler,
 [SYS_wait2] sys_wait2,
 [SYS_yield] sys_yield,
+[SYS_join_tid] sys_join_tid,
+[SYS_detach] sys_detach,
+[SYS_mmap]    sys_mmap,
+[SYS_munmap]  sys_munmap,
+[SYS_shmget]  sys_shmget,
+[SYS_shmat]   sys_shmat,
+[SYS_shmdt]   sys_shmdt,
+[SYS_shmrm]   sys_shmrm,
+[SYS_meminfo] sys_meminfo,
+[SYS_fsync]   sys_fsync,
+[SYS_sync]    sys_sync,
 };
 
 void
@@ -164,6 +206,7 @@ syscall(void)
   num = curproc->tf->eax;
   if(num > 0 && num < NELEM(syscalls) && syscalls[num]) {
     curproc->tf->eax = syscalls[num]();
+    uvmunpin();
   } else {
     cprintf("%d %s: unknown sys call %d\n",
             curproc->pid, curproc->name, num);
@@ -32,4 +32,15 @@
 #define SYS_getscheduler 31
 #define SYS_setscheduler 32
 #define SYS_wait2 33
-#define SYS_yield 34
\ No newline at end of file
+#define SYS_yield 34
+#define SYS_join_tid 35
+#define SYS_detach 36
+#define SYS_mmap 37
+#define SYS_munmap 38
+#define SYS_shmget 39
+#define SYS_shmat 40
+#define SYS_shmdt 41
+#define SYS_shmrm 42
+#define SYS_meminfo 43
+#define SYS_fsync 44
+#define SYS_sync 45
\ No newline at end of file
@@ -15,6 +15,7 @@
 #include "sleeplock.h"
 #include "file.h"
 #include "fcntl.h"
+#include "mman.h"
 
 // Fetch the nth word-sized system call argument as a file descriptor
 // and return both the descriptor and the corresponding struct file.
@@ -85,7 +86,7 @@ sys_write(void)
   int n;
   char *p;
 
-  if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argptr(1, &p, n) < 0)
+  if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argrdptr(1, &p, n) < 0)
     return -1;
   return filewrite(f, p, n);
 }
@@ -114,6 +115,25 @@ sys_fstat(void)
   return filestat(f, st);
 }
 
+int
+sys_fsync(void)
+{
+  struct file *f;
+
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  return filesync(f);
+}
+
+// Write all file data and metadata to disk.
+int
+sys_sync(void)
+{
+  bsync();
+  log_sync();
+  return 0;
+}
+
 // Create the path new as a link to the same inode as old.
 int
 sys_link(void)
@@ -443,3 +463,56 @@ sys_pipe(void)
   fd[1] = fd1;
   return 0;
 }
+
+// mmap(addr, len, prot, flags, fd, off): map len bytes of
+// fd from off, or zeroed memory if flags has MAP_ANON.
+// addr is only a hint and is ignored.
+int
+sys_mmap(void)
+{
+  struct file *f;
+  struct inode *ip;
+  int len, prot, flags, off, perm;
+  uint filesz, a;
+
+  if(argint(1, &len) < 0 || argint(2, &prot) < 0 ||
+     argint(3, &flags) < 0 || argint(5, &off) < 0)
+    return -1;
+  if(len <= 0 || off < 0 || off % PGSIZE != 0 ||
+     !(flags & MAP_SHARED) == !(flags & MAP_PRIVATE))
+    return -1;
+  perm = PTE_U;
+  if(prot & PROT_WRITE)
+    perm |= PTE_W;
+
+  ip = 0;
+  filesz = 0;
+  if(!(flags & MAP_ANON)){
+    if(argfd(4, 0, &f) < 0 || f->type != FD_INODE || !f->readable)
+      return -1;
+    if((flags & MAP_SHARED) && (prot & PROT_WRITE) && !f->writable)
+      return -1;
+    ip = f->ip;
+    ilock(ip);
+    if(ip->type != T_FILE){
+      iunlock(ip);
+      return -1;
+    }
+    if(off < ip->size)
+      filesz = ip->size - off < len ? ip->size - off : len;
+    iunlock(ip);
+  }
+  if((a = vmamap(ip, off, len, filesz, perm, (flags & MAP_SHARED) != 0)) == 0)
+    return -1;
+  return a;
+}
+
+int
+sys_munmap(void)
+{
+  int addr, len;
+
+  if(argint(0, &addr) < 0 || argint(1, &len) < 0 || len <= 0)
+    return -1;
+  return vmaunmap(addr, len);
+}
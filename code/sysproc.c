@@ -7,6 +7,7 @@
 #include "mmu.h"
 #include "proc.h"
 #include "ptable.h"
+#include "meminfo.h"
 
 int
 sys_fork(void)
@@ -51,8 +52,9 @@ sys_sbrk(void)
 
   if(argint(0, &n) < 0)
     return -1;
-  addr = myproc()->sz;
-  if(growproc(n) < 0)
+  // growproc() returns the old size, read under the
+  // vmspace lock, so racing threads get distinct blocks.
+  if((addr = growproc(n)) < 0)
     return -1;
   return addr;
 }
@@ -201,12 +203,94 @@ int sys_clone(void)
 
 int sys_join(void)
 {
-  int stack_add;
+  void **stack;
+
+  if (argptr(0, (void*)&stack, sizeof(*stack)) < 0)
+     return -1;
+
+  return join(stack);
+}
+
+int sys_join_tid(void)
+{
+  int tid;
+  void **stack;
 
-  if (argint(0, &stack_add) < 0)
+  if (argint(0, &tid) < 0)
+     return -1;
+  if (argptr(1, (void*)&stack, sizeof(*stack)) < 0)
      return -1;
 
-  return join((void **)stack_add);
+  return join_tid(tid, stack);
+}
+
+int sys_detach(void)
+{
+  int tid;
+
+  if (argint(0, &tid) < 0)
+     return -1;
+
+  return detach(tid);
+}
+
+int
+sys_shmget(void)
+{
+  int key, size;
+
+  if(argint(0, &key) < 0 || argint(1, &size) < 0)
+    return -1;
+  return shmget(key, size);
+}
+
+int
+sys_shmat(void)
+{
+  int id;
+
+  if(argint(0, &id) < 0)
+    return -1;
+  return shmat(id);
+}
+
+int
+sys_shmdt(void)
+{
+  int addr;
+
+  if(argint(0, &addr) < 0)
+    return -1;
+  return vmadetach(addr);
+}
+
+int
+sys_shmrm(void)
+{
+  int id;
+
+  if(argint(0, &id) < 0)
+    return -1;
+  return shmrm(id);
+}
+
+int
+sys_meminfo(void)
+{
+  struct meminfo *mi;
+  uint nused;
+
+  if(argptr(0, (void*)&mi, sizeof(*mi)) < 0)
+    return -1;
+  kmemstat(&mi->nfree, &nused, &mi->nsteal);
+  mi->npages = mi->nfree + nused;
+  mi->nptpages = vmsptpages();
+  swapstat(&mi->nswap, &mi->nswapused);
+  pipecachestat(&mi->npipe, &mi->npipepages);
+  icachestat(&mi->ninode, &mi->ninodepages);
+  filecachestat(&mi->nfile, &mi->nfilepages);
+  bstat(&mi->nbuf, &mi->nbhit, &mi->nbmiss, &mi->nbwb);
+  return 0;
 }
 
 int
@@ -0,0 +1,121 @@
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "uthread.h"
+
+#define NTHREAD 4
+#define N 10000
+
+static int key;
+static volatile int failed;
+static char *brks[NTHREAD];
+static volatile int sum;
+static volatile int ndetached;
+
+static void
+tlsworker(void *arg)
+{
+  int i;
+
+  uthread_setspecific(key, arg);
+  for(i = 0; i < 20; i++){
+    yield();
+    if(uthread_getspecific(key) != arg)
+      failed = 1;
+  }
+}
+
+static void
+sbrkworker(void *arg)
+{
+  brks[(int)arg] = sbrk(4096);
+}
+
+static void
+detachworker(void *arg)
+{
+  fetch_and_add(&ndetached, 1);
+}
+
+static void
+add(int i, void *arg)
+{
+  fetch_and_add(&sum, i);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int i, j, tids[NTHREAD];
+  char *start;
+  struct upool *pool;
+
+  // Thread-local storage.
+  key = uthread_key_create();
+  uthread_setspecific(key, (void*)-1);
+  for(i = 0; i < NTHREAD; i++)
+    tids[i] = uthread_create(tlsworker, (void*)(i+1));
+  for(i = 0; i < NTHREAD; i++)
+    uthread_join(tids[i]);
+  if(failed || uthread_getspecific(key) != (void*)-1){
+    printf(1, "thread_test: tls FAILED\n");
+    exit();
+  }
+  printf(1, "thread_test: tls ok\n");
+
+  // sbrk() from several threads grows one shared address space.
+  start = sbrk(0);
+  for(i = 0; i < NTHREAD; i++)
+    tids[i] = uthread_create(sbrkworker, (void*)i);
+  for(i = 0; i < NTHREAD; i++)
+    uthread_join(tids[i]);
+  for(i = 0; i < NTHREAD; i++){
+    if(brks[i] == (char*)-1)
+      failed = 1;
+    for(j = 0; j < i; j++)
+      if(brks[i] == brks[j])
+        failed = 1;
+  }
+  if(failed || sbrk(0) != start + NTHREAD*4096){
+    printf(1, "thread_test: sbrk FAILED\n");
+    exit();
+  }
+  printf(1, "thread_test: sbrk ok\n");
+
+  // Detached threads are freed on exit and cannot be joined;
+  // joinable ones can be joined in any order.
+  for(i = 0; i < NTHREAD; i++){
+    tids[i] = uthread_create(detachworker, 0);
+    if(uthread_detach(tids[i]) < 0)
+      failed = 1;
+  }
+  while(ndetached < NTHREAD)
+    yield();
+  for(i = 0; i < NTHREAD; i++)
+    if(uthread_join(tids[i]) == 0)
+      failed = 1;
+  for(i = 0; i < NTHREAD; i++)
+    tids[i] = uthread_create(detachworker, 0);
+  for(i = NTHREAD-1; i >= 0; i--)
+    if(uthread_join(tids[i]) < 0)
+      failed = 1;
+  if(failed || ndetached != 2*NTHREAD){
+    printf(1, "thread_test: join_tid/detach FAILED\n");
+    exit();
+  }
+  printf(1, "thread_test: join_tid/detach ok\n");
+
+  // Work-stealing pool.
+  if((pool = upool_create(NTHREAD)) == 0){
+    printf(1, "thread_test: upool_create FAILED\n");
+    exit();
+  }
+  parallel_for(pool, 0, N, 0, add, 0);
+  upool_destroy(pool);
+  if(sum != N*(N-1)/2){
+    printf(1, "thread_test: parallel_for FAILED %d\n", sum);
+    exit();
+  }
+  printf(1, "thread_test: parallel_for ok\n");
+  exit();
+}
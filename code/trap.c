@@ -79,6 +79,23 @@ trap(struct trapframe *tf)
     lapiceoi();
     break;
 
+  case T_PGFLT:
+    // Untouched heap or a copy-on-write page, from user
+    // space or from the kernel accessing user memory.
+    if(myproc() != 0 && pagefault(rcr2(), tf->err & FEC_WR) == 0)
+      break;
+    // The kernel touching a user buffer that it checked
+    // and faulted in, but that pagefault() cannot fill in
+    // again just now, when memory has run out.  Kill the process, and wait
+    // for a page rather than panic; returning retries the
+    // access.
+    if(myproc() != 0 && (tf->cs&3) == 0 && rcr2() < KERNBASE &&
+       (!(tf->err & FEC_PR) || (tf->err & FEC_WR)) && pagewait(rcr2()) == 0){
+      myproc()->killed = 1;
+      break;
+    }
+    // fall through
+
   //PAGEBREAK: 13
   default:
     if(myproc() == 0 || (tf->cs&3) == 0){
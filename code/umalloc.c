@@ -1,90 +1,254 @@
 #include "types.h"
 #include "stat.h"
 #include "user.h"
-#include "param.h"
+#include "mmu.h"
+#include "x86.h"
+#include "mman.h"
 
-// Memory allocator by Kernighan and Ritchie,
-// The C programming Language, 2nd ed.  Section 8.7.
+// Memory allocator.
+//
+// Small requests come from segregated size classes, powers
+// of two from 16 to 2048 bytes, each kept on its own free
+// list.  A thread allocates from and frees to one of NCACHE
+// caches of such lists, which it shares with few or no other
+// threads; blocks move between a cache and the central lists
+// BATCH at a time, so malloc() and free() take constant time
+// and rarely need the central lock.  Larger requests take
+// whole pages: runs of up to NRUN pages are kept on free
+// lists by length, and anything bigger comes straight from
+// mmap(), or from sbrk() if there is no room for another
+// mapping.
+//
+// Each block starts with a header saying which of these it
+// is, so that free() knows where to put it back.
 
-typedef long Align;
+#define NSMALL    8               // size classes 16, 32, ..., 2048
+#define SMALLMAX  (16 << (NSMALL-1))
+#define NRUN      32              // longest page run kept for reuse
+#define BATCH     16              // blocks moved between cache and heap
+#define CACHEMAX  (2*BATCH)       // a cache holding more gives a batch back
+#define NCACHE    8
+#define CHUNK     (16*PGSIZE)     // grow the heap this much at a time
 
-union header {
-  struct {
-    union header *ptr;
-    uint size;
-  } s;
-  Align x;
+// Block kinds other than small size classes.
+#define RUN     NSMALL            // page run of npage pages
+#define BIG     (NSMALL+1)        // longer run from sbrk()
+#define MAPPED  (NSMALL+2)        // mmap()ed; returned with munmap()
+
+struct block {
+  uint cls;               // size class or kind
+  uint npage;             // pages, unless a small block
+  struct block *next;     // on a free list; else the caller's data
 };
 
-typedef union header Header;
+#define HDR  8            // bytes of header before the caller's data
 
-static Header base;
-static Header *freep;
+struct cache {
+  volatile uint lock;
+  struct block *bin[NSMALL];
+  int n[NSMALL];
+};
 
-void
-free(void *ap)
+static struct {
+  volatile uint lock;
+  struct block *bin[NSMALL];
+  struct block *run[NRUN+1];  // free page runs by length
+  struct block *big;          // free BIG blocks
+  char *top;                  // unused part of the last sbrk()
+  char *end;
+} heap;
+
+static struct cache caches[NCACHE];
+
+// Set by the thread library to tell threads apart, so that
+// each uses its own cache.  Without it everyone uses cache 0.
+int (*umalloc_thread)(void);
+
+static void
+lock(volatile uint *l)
 {
-  Header *bp, *p;
+  while(xchg(l, 1) != 0)
+    yield();
+}
 
-  bp = (Header*)ap - 1;
-  for(p = freep; !(bp > p && bp < p->s.ptr); p = p->s.ptr)
-    if(p >= p->s.ptr && (bp > p || bp < p->s.ptr))
-      break;
-  if(bp + bp->s.size == p->s.ptr){
-    bp->s.size += p->s.ptr->s.size;
-    bp->s.ptr = p->s.ptr->s.ptr;
-  } else
-    bp->s.ptr = p->s.ptr;
-  if(p + p->s.size == bp){
-    p->s.size += bp->s.size;
-    p->s.ptr = bp->s.ptr;
-  } else
-    p->s.ptr = bp;
-  freep = p;
+static void
+unlock(volatile uint *l)
+{
+  xchg(l, 0);
+}
+
+static struct cache*
+mycache(void)
+{
+  return &caches[umalloc_thread ? umalloc_thread() % NCACHE : 0];
 }
 
-static Header*
-morecore(uint nu)
+// Take n bytes, a multiple of 16, from the end of the heap.
+// Caller holds heap.lock.
+static struct block*
+morecore(uint n)
 {
   char *p;
-  Header *hp;
+  uint m;
 
-  if(nu < 4096)
-    nu = 4096;
-  p = sbrk(nu * sizeof(Header));
-  if(p == (char*)-1)
-    return 0;
-  hp = (Header*)p;
-  hp->s.size = nu;
-  free((void*)(hp + 1));
-  return freep;
+  if(heap.end - heap.top < n){
+    m = PGROUNDUP(n + 16);
+    if(m < CHUNK)
+      m = CHUNK;
+    if(m < n || (p = sbrk(m)) == (char*)-1)
+      return 0;
+    // Someone else moved the break: drop the old piece.
+    if(p != heap.end)
+      heap.top = (char*)(((uint)p + 15) & ~15);
+    heap.end = p + m;
+  }
+  p = heap.top;
+  heap.top += n;
+  return (struct block*)p;
 }
 
-void*
-malloc(uint nbytes)
+// Move up to BATCH blocks of class k from the heap to c.
+// Caller holds c->lock.
+static void
+refill(struct cache *c, int k)
 {
-  Header *p, *prevp;
-  uint nunits;
+  struct block *b;
+  int i;
 
-  nunits = (nbytes + sizeof(Header) - 1)/sizeof(Header) + 1;
-  if((prevp = freep) == 0){
-    base.s.ptr = freep = prevp = &base;
-    base.s.size = 0;
+  lock(&heap.lock);
+  for(i = 0; i < BATCH; i++){
+    if((b = heap.bin[k]) != 0)
+      heap.bin[k] = b->next;
+    else if((b = morecore(16 << k)) != 0)
+      b->cls = k;
+    else
+      break;
+    b->next = c->bin[k];
+    c->bin[k] = b;
+    c->n[k]++;
   }
-  for(p = prevp->s.ptr; ; prevp = p, p = p->s.ptr){
-    if(p->s.size >= nunits){
-      if(p->s.size == nunits)
-        prevp->s.ptr = p->s.ptr;
-      else {
-        p->s.size -= nunits;
-        p += p->s.size;
-        p->s.size = nunits;
+  unlock(&heap.lock);
+}
+
+// Give BATCH blocks of class k back to the heap.
+// Caller holds c->lock.
+static void
+drain(struct cache *c, int k)
+{
+  struct block *b;
+  int i;
+
+  lock(&heap.lock);
+  for(i = 0; i < BATCH; i++){
+    b = c->bin[k];
+    c->bin[k] = b->next;
+    c->n[k]--;
+    b->next = heap.bin[k];
+    heap.bin[k] = b;
+  }
+  unlock(&heap.lock);
+}
+
+static void*
+bigalloc(uint nbytes)
+{
+  struct block *b, **pp;
+  uint npage;
+
+  if(nbytes + HDR < nbytes)
+    return 0;
+  npage = PGROUNDUP(nbytes + HDR) / PGSIZE;
+  if(npage > NRUN){
+    b = mmap(0, npage*PGSIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON, -1, 0);
+    if(b != (struct block*)-1){
+      b->cls = MAPPED;
+      b->npage = npage;
+      return (char*)b + HDR;
+    }
+  }
+
+  lock(&heap.lock);
+  b = 0;
+  if(npage <= NRUN){
+    if((b = heap.run[npage]) != 0)
+      heap.run[npage] = b->next;
+  } else {
+    for(pp = &heap.big; *pp; pp = &(*pp)->next){
+      if((*pp)->npage >= npage){
+        b = *pp;
+        *pp = b->next;
+        break;
       }
-      freep = prevp;
-      return (void*)(p + 1);
     }
-    if(p == freep)
-      if((p = morecore(nunits)) == 0)
-        return 0;
   }
+  if(b == 0 && (b = morecore(npage*PGSIZE)) != 0){
+    b->cls = npage <= NRUN ? RUN : BIG;
+    b->npage = npage;
+  }
+  unlock(&heap.lock);
+  return b ? (char*)b + HDR : 0;
+}
+
+static void
+bigfree(struct block *b)
+{
+  if(b->cls == MAPPED){
+    munmap(b, b->npage*PGSIZE);
+    return;
+  }
+  lock(&heap.lock);
+  if(b->cls == RUN){
+    b->next = heap.run[b->npage];
+    heap.run[b->npage] = b;
+  } else {
+    b->next = heap.big;
+    heap.big = b;
+  }
+  unlock(&heap.lock);
+}
+
+void
+free(void *ap)
+{
+  struct block *b;
+  struct cache *c;
+  int k;
+
+  if(ap == 0)
+    return;
+  b = (struct block*)((char*)ap - HDR);
+  if((k = b->cls) >= NSMALL){
+    bigfree(b);
+    return;
+  }
+  c = mycache();
+  lock(&c->lock);
+  b->next = c->bin[k];
+  c->bin[k] = b;
+  if(++c->n[k] > CACHEMAX)
+    drain(c, k);
+  unlock(&c->lock);
+}
+
+void*
+malloc(uint nbytes)
+{
+  struct block *b;
+  struct cache *c;
+  int k;
+
+  if(nbytes > SMALLMAX - HDR)
+    return bigalloc(nbytes);
+  for(k = 0; (16 << k) < nbytes + HDR; k++)
+    ;
+  c = mycache();
+  lock(&c->lock);
+  if(c->bin[k] == 0)
+    refill(c, k);
+  if((b = c->bin[k]) != 0){
+    c->bin[k] = b->next;
+    c->n[k]--;
+  }
+  unlock(&c->lock);
+  return b ? (char*)b + HDR : 0;
 }
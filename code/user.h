@@ -1,5 +1,6 @@
 struct stat;
 struct rtcdate;
+struct meminfo;
 
 // system calls
 int fork(void);
@@ -31,6 +32,17 @@ int sem_wait(int sem, int count);
 int sem_signal(int sem, int count);
 int clone(void (*)(void*), void *arg, void *stack);
 int join(void **stack);
+int join_tid(int tid, void **stack);
+int detach(int tid);
+void* mmap(void*, int, int, int, int, int);
+int munmap(void*, int);
+int shmget(int key, int size);
+void* shmat(int id);
+int shmdt(void*);
+int shmrm(int id);
+int meminfo(struct meminfo*);
+int fsync(int);
+int sync(void);
 int getscheduler(void);
 int setscheduler(int);
 int wait2(int *,int *,int *);
@@ -48,6 +60,7 @@ uint strlen(char*);
 void* memset(void*, int, uint);
 void* malloc(uint);
 void free(void*);
+extern int (*umalloc_thread)(void);
 int atoi(const char*);
 
 int getptable(void *buf, int size);
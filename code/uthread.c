@@ -0,0 +1,519 @@
+// User-level threads on top of clone() and join().
+//
+// Each thread is a kernel proc sharing its creator's address
+// space.  Its stack is UTHREAD_STACK bytes from malloc(); the
+// bottom UTHREAD_GUARD bytes hold a canary that is checked when
+// the thread is joined, since user code cannot unmap a real
+// guard page.  clone() builds the thread's first frame in the
+// top page of the stack it is given, so we pass it the address
+// of that page.
+//
+// Thread-local storage is a small per-thread array of slots;
+// a thread finds its own slots by looking up which stack its
+// %esp lies in, without a system call.
+//
+// A detached thread is freed by the kernel when it exits.
+// Its stack is freed by the next uthread_create() that finds
+// it UT_DEAD; the thread marks itself dead and exits without
+// touching its stack again, so that is safe at any time.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "mmu.h"
+#include "x86.h"
+#include "syscall.h"
+#include "traps.h"
+#include "uthread.h"
+
+#define UTHREAD_CANARY 0xA5
+
+enum { UT_FREE, UT_LIVE, UT_DEAD };
+
+struct uthread {
+  int state;
+  int tid;
+  int detached;
+  char *stack;            // bottom of the thread's stack
+  void (*fn)(void*);
+  void *arg;
+  void *tls[UTHREAD_NKEYS];
+};
+
+static struct uthread threads[UTHREAD_MAX];
+static struct uthread mainthread;
+static struct ulock tlock;   // protects threads[] and nkeys
+static int nkeys;
+
+void
+ulock_init(struct ulock *l)
+{
+  l->locked = 0;
+}
+
+void
+ulock_acquire(struct ulock *l)
+{
+  while(xchg(&l->locked, 1) != 0)
+    yield();
+}
+
+void
+ulock_release(struct ulock *l)
+{
+  xchg(&l->locked, 0);
+}
+
+// Atomically add v to *addr and return the old value.
+int
+fetch_and_add(volatile int *addr, int v)
+{
+  asm volatile("lock; xaddl %0, %1" :
+               "+r" (v), "+m" (*addr) :
+               : "memory", "cc");
+  return v;
+}
+
+// Return the calling thread's descriptor.
+static struct uthread*
+self(void)
+{
+  struct uthread *t;
+  char *sp;
+
+  sp = (char*)&t;
+  for(t = threads; t < &threads[UTHREAD_MAX]; t++)
+    if(t->state == UT_LIVE && sp >= t->stack && sp < t->stack + UTHREAD_STACK)
+      return t;
+  return &mainthread;
+}
+
+// Number the calling thread for malloc(), which gives
+// each thread its own cache of free blocks.
+static int
+mallocthread(void)
+{
+  struct uthread *t;
+
+  t = self();
+  return t == &mainthread ? 0 : t - threads + 1;
+}
+
+static void
+uthread_start(void *arg)
+{
+  struct uthread *t = arg;
+  uint zero = 0;
+
+  t->fn(t->arg);
+
+  ulock_acquire(&tlock);
+  if(t->detached){
+    // Once tlock is dropped our stack may be freed, so
+    // release it and call exit() with no further pushes.
+    t->state = UT_DEAD;
+    asm volatile("xchgl %0, %1\n\t"
+                 "movl %2, %%eax\n\t"
+                 "int %3" :
+                 "+r" (zero), "+m" (tlock.locked) :
+                 "i" (SYS_exit), "i" (T_SYSCALL) :
+                 "eax", "memory");
+  }
+  ulock_release(&tlock);
+  exit();
+}
+
+// Release the descriptor of a reaped thread.
+// Caller must hold tlock.
+static void
+reap(struct uthread *t)
+{
+  int i;
+
+  for(i = 0; i < UTHREAD_GUARD; i++){
+    if((uchar)t->stack[i] != UTHREAD_CANARY){
+      printf(2, "uthread %d: stack overflow\n", t->tid);
+      break;
+    }
+  }
+  free(t->stack);
+  t->stack = 0;
+  t->state = UT_FREE;
+}
+
+// Start a thread running fn(arg).  Returns its thread id,
+// or -1 if there is no free descriptor or memory.
+int
+uthread_create(void (*fn)(void*), void *arg)
+{
+  struct uthread *t;
+  char *stack;
+  int tid;
+
+  ulock_acquire(&tlock);
+  for(t = threads; t < &threads[UTHREAD_MAX]; t++){
+    if(t->state == UT_DEAD)
+      reap(t);
+    if(t->state == UT_FREE)
+      break;
+  }
+  if(t == &threads[UTHREAD_MAX] || (stack = malloc(UTHREAD_STACK)) == 0){
+    ulock_release(&tlock);
+    return -1;
+  }
+  memset(stack, UTHREAD_CANARY, UTHREAD_GUARD);
+  memset(t->tls, 0, sizeof(t->tls));
+  t->stack = stack;
+  t->fn = fn;
+  t->arg = arg;
+  t->tid = 0;
+  t->detached = 0;
+  t->state = UT_LIVE;
+  umalloc_thread = mallocthread;
+  ulock_release(&tlock);
+
+  tid = clone(uthread_start, t, stack + UTHREAD_STACK - PGSIZE);
+  ulock_acquire(&tlock);
+  if(tid < 0){
+    t->state = UT_FREE;
+    free(stack);
+  } else
+    t->tid = tid;
+  ulock_release(&tlock);
+  return tid;
+}
+
+static struct uthread*
+lookup(int tid)
+{
+  struct uthread *t;
+
+  for(t = threads; t < &threads[UTHREAD_MAX]; t++)
+    if(t->state == UT_LIVE && t->tid == tid)
+      return t;
+  return 0;
+}
+
+// Wait for thread tid to exit.  Only the thread that
+// created tid may join it.  Returns 0, or -1 if tid is
+// not a joinable thread of ours.
+int
+uthread_join(int tid)
+{
+  struct uthread *t;
+  void *stack;
+
+  if(join_tid(tid, &stack) < 0)
+    return -1;
+  ulock_acquire(&tlock);
+  if((t = lookup(tid)) != 0)
+    reap(t);
+  ulock_release(&tlock);
+  return 0;
+}
+
+// Let thread tid be freed when it exits, instead of
+// being joined.  Returns 0, or -1 if tid is not a
+// joinable thread of ours.
+int
+uthread_detach(int tid)
+{
+  struct uthread *t;
+  int r;
+
+  ulock_acquire(&tlock);
+  if((t = lookup(tid)) == 0){
+    ulock_release(&tlock);
+    return -1;
+  }
+  // The thread checks t->detached under tlock before it
+  // exits, so it sees the flag iff the kernel does too.
+  t->detached = 1;
+  if((r = detach(tid)) == 1)
+    reap(t);  // it had already exited
+  else if(r < 0)
+    t->detached = 0;
+  ulock_release(&tlock);
+  return r < 0 ? -1 : 0;
+}
+
+// Every thread is a kernel proc with its own pid.
+int
+uthread_self(void)
+{
+  return getpid();
+}
+
+// Allocate a thread-local storage key.  Every thread's
+// slot for the new key starts out as 0.
+int
+uthread_key_create(void)
+{
+  int key;
+
+  ulock_acquire(&tlock);
+  key = nkeys < UTHREAD_NKEYS ? nkeys++ : -1;
+  ulock_release(&tlock);
+  return key;
+}
+
+void*
+uthread_getspecific(int key)
+{
+  if(key < 0 || key >= UTHREAD_NKEYS)
+    return 0;
+  return self()->tls[key];
+}
+
+int
+uthread_setspecific(int key, void *v)
+{
+  if(key < 0 || key >= UTHREAD_NKEYS)
+    return -1;
+  self()->tls[key] = v;
+  return 0;
+}
+
+//PAGEBREAK!
+// Work-stealing thread pool.
+
+static int
+dqpush(struct udeque *dq, struct utask *t)
+{
+  ulock_acquire(&dq->lock);
+  if(dq->bottom - dq->top == UPOOL_DEQUE){
+    ulock_release(&dq->lock);
+    return -1;
+  }
+  dq->tasks[dq->bottom++ % UPOOL_DEQUE] = *t;
+  ulock_release(&dq->lock);
+  return 0;
+}
+
+// Owner end: newest task first, while its data is still in cache.
+static int
+dqpop(struct udeque *dq, struct utask *t)
+{
+  ulock_acquire(&dq->lock);
+  if(dq->bottom == dq->top){
+    ulock_release(&dq->lock);
+    return -1;
+  }
+  *t = dq->tasks[--dq->bottom % UPOOL_DEQUE];
+  ulock_release(&dq->lock);
+  return 0;
+}
+
+// Thief end: oldest task first, which tends to be the biggest.
+static int
+dqsteal(struct udeque *dq, struct utask *t)
+{
+  ulock_acquire(&dq->lock);
+  if(dq->bottom == dq->top){
+    ulock_release(&dq->lock);
+    return -1;
+  }
+  *t = dq->tasks[dq->top++ % UPOOL_DEQUE];
+  ulock_release(&dq->lock);
+  return 0;
+}
+
+// Find a task for the owner of deque me: its own first,
+// then steal from the others.
+static int
+take(struct upool *pool, int me, struct utask *t)
+{
+  int i, n;
+
+  if(dqpop(&pool->deque[me], t) == 0)
+    return 0;
+  n = pool->nworkers + 1;
+  for(i = 1; i < n; i++)
+    if(dqsteal(&pool->deque[(me + i) % n], t) == 0)
+      return 0;
+  return -1;
+}
+
+static void
+run(struct upool *pool, struct utask *t)
+{
+  t->fn(t->arg);
+  fetch_and_add(&pool->pending, -1);
+}
+
+// Called after a failed take().  Yield for the first
+// UPOOL_SPIN tries, so that new work is picked up at once,
+// then sleep a tick at a time so that an idle pool does
+// not keep every CPU busy.
+static void
+idle(int *nidle)
+{
+  if(*nidle < UPOOL_SPIN){
+    (*nidle)++;
+    yield();
+  } else
+    sleep(1);
+}
+
+static void
+worker(void *arg)
+{
+  struct upool *pool = arg;
+  struct utask t;
+  int me, nidle;
+
+  me = fetch_and_add(&pool->nstarted, 1) + 1;
+  uthread_setspecific(pool->key, (void*)me);
+  nidle = 0;
+  for(;;){
+    if(take(pool, me, &t) == 0){
+      run(pool, &t);
+      nidle = 0;
+    } else if(pool->shutdown)
+      break;
+    else
+      idle(&nidle);
+  }
+}
+
+// Create a pool of n worker threads.
+struct upool*
+upool_create(int n)
+{
+  struct upool *pool;
+  int i;
+
+  if(n < 1)
+    n = 1;
+  if(n > UPOOL_MAXWORKERS)
+    n = UPOOL_MAXWORKERS;
+  if((pool = malloc(sizeof(*pool))) == 0)
+    return 0;
+  memset(pool, 0, sizeof(*pool));
+  for(i = 0; i <= n; i++)
+    ulock_init(&pool->deque[i].lock);
+  if((pool->key = uthread_key_create()) < 0){
+    free(pool);
+    return 0;
+  }
+  pool->nworkers = n;
+  for(i = 0; i < n; i++){
+    if((pool->tids[i] = uthread_create(worker, pool)) < 0){
+      pool->nworkers = i;
+      upool_destroy(pool);
+      return 0;
+    }
+  }
+  return pool;
+}
+
+// Queue fn(arg) on the caller's deque.  If the deque
+// is full, run the task right away instead.
+int
+upool_submit(struct upool *pool, void (*fn)(void*), void *arg)
+{
+  struct utask t;
+  int me;
+
+  t.fn = fn;
+  t.arg = arg;
+  me = (int)uthread_getspecific(pool->key);
+  fetch_and_add(&pool->pending, 1);
+  if(dqpush(&pool->deque[me], &t) < 0)
+    run(pool, &t);
+  return 0;
+}
+
+// Run tasks until *count drops to zero.
+static void
+helpuntil(struct upool *pool, volatile int *count)
+{
+  struct utask t;
+  int me, nidle;
+
+  me = (int)uthread_getspecific(pool->key);
+  nidle = 0;
+  while(*count > 0){
+    if(take(pool, me, &t) == 0){
+      run(pool, &t);
+      nidle = 0;
+    } else
+      idle(&nidle);
+  }
+}
+
+// Wait until every submitted task has finished,
+// running tasks in the meantime.
+void
+upool_wait(struct upool *pool)
+{
+  helpuntil(pool, &pool->pending);
+}
+
+void
+upool_destroy(struct upool *pool)
+{
+  int i;
+
+  upool_wait(pool);
+  pool->shutdown = 1;
+  for(i = 0; i < pool->nworkers; i++)
+    uthread_join(pool->tids[i]);
+  free(pool);
+}
+
+struct pfchunk {
+  void (*fn)(int, void*);
+  void *arg;
+  int lo, hi;
+  volatile int *left;
+};
+
+static void
+pfrun(void *arg)
+{
+  struct pfchunk *c = arg;
+  int i;
+
+  for(i = c->lo; i < c->hi; i++)
+    c->fn(i, c->arg);
+  fetch_and_add(c->left, -1);
+}
+
+// Call fn(i, arg) for every i in [lo, hi), in chunks of
+// grain iterations spread over the pool.  A grain <= 0
+// picks one that gives each thread a few chunks.
+// Returns once every iteration has run.
+int
+parallel_for(struct upool *pool, int lo, int hi, int grain,
+             void (*fn)(int, void*), void *arg)
+{
+  struct pfchunk *c;
+  volatile int left;
+  int i, n;
+
+  if(hi <= lo)
+    return 0;
+  if(grain <= 0)
+    grain = (hi - lo) / (4 * (pool->nworkers + 1));
+  if(grain <= 0)
+    grain = 1;
+  n = (hi - lo + grain - 1) / grain;
+  if((c = malloc(n * sizeof(*c))) == 0){
+    for(i = lo; i < hi; i++)
+      fn(i, arg);
+    return 0;
+  }
+  left = n;
+  for(i = 0; i < n; i++){
+    c[i].fn = fn;
+    c[i].arg = arg;
+    c[i].lo = lo + i*grain;
+    c[i].hi = c[i].lo + grain < hi ? c[i].lo + grain : hi;
+    c[i].left = &left;
+    upool_submit(pool, pfrun, &c[i]);
+  }
+  helpuntil(pool, &left);
+  free(c);
+  return 0;
+}
@@ -0,0 +1,64 @@
+// User-level threads, thread-local storage and a
+// work-stealing thread pool, built on clone() and join().
+// Programs that use them link uthread.o (see UTHREAD in Makefile).
+
+#define UTHREAD_MAX     64          // max live threads per process
+#define UTHREAD_STACK   (4*4096)    // bytes of stack per thread
+#define UTHREAD_GUARD   256         // canary bytes at the stack bottom
+#define UTHREAD_NKEYS   16          // thread-local storage keys
+
+#define UPOOL_MAXWORKERS 8          // max worker threads per pool
+#define UPOOL_DEQUE      256        // tasks per worker deque
+#define UPOOL_SPIN       64         // failed takes before an idle thread sleeps
+
+// Spin lock for user threads.  Spins with yield()
+// so that a preempted holder gets to run.
+struct ulock {
+  volatile uint locked;
+};
+
+struct utask {
+  void (*fn)(void*);
+  void *arg;
+};
+
+// Per-worker double-ended task queue.  The owner pushes
+// and pops at the bottom, thieves steal from the top.
+struct udeque {
+  struct ulock lock;
+  uint top;
+  uint bottom;
+  struct utask tasks[UPOOL_DEQUE];
+};
+
+struct upool {
+  int nworkers;
+  int key;                          // TLS key holding the caller's deque index
+  volatile int pending;             // tasks submitted but not yet finished
+  volatile int shutdown;
+  volatile int nstarted;            // workers that have picked a deque
+  int tids[UPOOL_MAXWORKERS];
+  // deque[0] takes submissions from non-worker threads;
+  // deque[i+1] belongs to worker i.
+  struct udeque deque[UPOOL_MAXWORKERS+1];
+};
+
+// uthread.c
+void  ulock_init(struct ulock*);
+void  ulock_acquire(struct ulock*);
+void  ulock_release(struct ulock*);
+int   fetch_and_add(volatile int*, int);
+
+int   uthread_create(void (*)(void*), void*);
+int   uthread_join(int);
+int   uthread_detach(int);
+int   uthread_self(void);
+int   uthread_key_create(void);
+void* uthread_getspecific(int);
+int   uthread_setspecific(int, void*);
+
+struct upool* upool_create(int);
+int   upool_submit(struct upool*, void (*)(void*), void*);
+void  upool_wait(struct upool*);
+void  upool_destroy(struct upool*);
+int   parallel_for(struct upool*, int, int, int, void (*)(int, void*), void*);
@@ -6,6 +6,11 @@
 #include "mmu.h"
 #include "proc.h"
 #include "elf.h"
+#include "spinlock.h"
+#include "vmspace.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
 
 extern char data[];  // defined by kernel.ld
 pde_t *kpgdir;  // for use in scheduler()
@@ -79,6 +84,30 @@ mappages(pde_t *pgdir, void *va, uint size, uint pa, int perm)
   return 0;
 }
 
+// Like mappages, but map each 4-Mbyte-aligned stretch with
+// a single PTE_PS directory entry rather than a page table.
+// Only for kernel mappings, which walkpgdir() never visits.
+static int
+mapkvm(pde_t *pgdir, uint va, uint size, uint pa, int perm)
+{
+  uint end;
+
+  end = va + size;
+  while(va != end){
+    if(va % BIGPGSIZE == 0 && pa % BIGPGSIZE == 0 && end - va >= BIGPGSIZE){
+      pgdir[PDX(va)] = pa | perm | PTE_P | PTE_PS;
+      va += BIGPGSIZE;
+      pa += BIGPGSIZE;
+    } else {
+      if(mappages(pgdir, (void*)va, PGSIZE, pa, perm) < 0)
+        return -1;
+      va += PGSIZE;
+      pa += PGSIZE;
+    }
+  }
+  return 0;
+}
+
 // There is one page table per process, plus one that's used when
 // a CPU is not running any process (kpgdir). The kernel uses the
 // current process's page table during system calls and interrupts;
@@ -96,6 +125,9 @@ mappages(pde_t *pgdir, void *va, uint size, uint pa, int perm)
 //                                  rw data + free physical memory
 //   0xfe000000..0: mapped direct (devices such as ioapic)
 //
+// Past the first 4 Mbytes, which hold the kernel image, the
+// kernel mappings use 4-Mbyte pages (see mapkvm).
+//
 // The kernel allocates physical memory for its heap and for user memory
 // between V2P(end) and the end of physical memory (PHYSTOP)
 // (directly addressable from end..P2V(PHYSTOP)).
@@ -114,33 +146,40 @@ static struct kmap {
  { (void*)DEVSPACE, DEVSPACE,      0,         PTE_W}, // more devices
 };
 
-// Set up kernel part of a page table.
+// Set up kernel part of a page table.  The kernel mappings
+// never change after boot, so every page table shares the
+// page-table pages of kpgdir and only copies its directory
+// entries; freevm() leaves them alone.
 pde_t*
 setupkvm(void)
 {
   pde_t *pgdir;
-  struct kmap *k;
 
   if((pgdir = (pde_t*)kalloc()) == 0)
     return 0;
-  memset(pgdir, 0, PGSIZE);
-  if (P2V(PHYSTOP) > (void*)DEVSPACE)
-    panic("PHYSTOP too high");
-  for(k = kmap; k < &kmap[NELEM(kmap)]; k++)
-    if(mappages(pgdir, k->virt, k->phys_end - k->phys_start,
-                (uint)k->phys_start, k->perm) < 0) {
-      freevm(pgdir);
-      return 0;
-    }
+  memset(pgdir, 0, PDX(KERNBASE)*sizeof(pde_t));
+  memmove(&pgdir[PDX(KERNBASE)], &kpgdir[PDX(KERNBASE)],
+          (NPDENTRIES - PDX(KERNBASE))*sizeof(pde_t));
   return pgdir;
 }
 
 // Allocate one page table for the machine for the kernel address
-// space for scheduler processes.
+// space for scheduler processes, and build the kernel mappings
+// that setupkvm() hands on to every other page table.
 void
 kvmalloc(void)
 {
-  kpgdir = setupkvm();
+  struct kmap *k;
+
+  if((kpgdir = (pde_t*)kalloc()) == 0)
+    panic("kvmalloc");
+  memset(kpgdir, 0, PGSIZE);
+  if (P2V(PHYSTOP) > (void*)DEVSPACE)
+    panic("PHYSTOP too high");
+  for(k = kmap; k < &kmap[NELEM(kmap)]; k++)
+    if(mapkvm(kpgdir, (uint)k->virt, k->phys_end - k->phys_start,
+              (uint)k->phys_start, k->perm) < 0)
+      panic("kvmalloc: mapkvm");
   switchkvm();
 }
 
@@ -160,7 +199,7 @@ switchuvm(struct proc *p)
     panic("switchuvm: no process");
   if(p->kstack == 0)
     panic("switchuvm: no kstack");
-  if(p->pgdir == 0)
+  if(p->vm == 0 || p->vm->pgdir == 0)
     panic("switchuvm: no pgdir");
 
   pushcli();
@@ -173,7 +212,12 @@ switchuvm(struct proc *p)
   // forbids I/O instructions (e.g., inb and outb) from user space
   mycpu()->ts.iomb = (ushort) 0xFFFF;
   ltr(SEG_TSS << 3);
-  lcr3(V2P(p->pgdir));  // switch to process's address space
+  // Record the switch under vm->lock, so that swapout()
+  // knows which CPUs may cache p's page table entries.
+  acquire(&p->vm->lock);
+  mycpu()->vm = p->vm;
+  lcr3(V2P(p->vm->pgdir));  // switch to process's address space
+  release(&p->vm->lock);
   popcli();
 }
 
@@ -192,30 +236,6 @@ inituvm(pde_t *pgdir, char *init, uint sz)
   memmove(mem, init, sz);
 }
 
-// Load a program segment into pgdir.  addr must be page-aligned
-// and the pages from addr to addr+sz must already be mapped.
-int
-loaduvm(pde_t *pgdir, char *addr, struct inode *ip, uint offset, uint sz)
-{
-  uint i, pa, n;
-  pte_t *pte;
-
-  if((uint) addr % PGSIZE != 0)
-    panic("loaduvm: addr must be page aligned");
-  for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walkpgdir(pgdir, addr+i, 0)) == 0)
-      panic("loaduvm: address should exist");
-    pa = PTE_ADDR(*pte);
-    if(sz - i < PGSIZE)
-      n = sz - i;
-    else
-      n = PGSIZE;
-    if(readi(ip, P2V(pa), offset+i, n) != n)
-      return -1;
-  }
-  return 0;
-}
-
 // Allocate page tables and physical memory to grow process from oldsz to
 // newsz, which need not be page aligned.  Returns new size or 0 on error.
 int
@@ -238,7 +258,9 @@ allocuvm(pde_t *pgdir, uint oldsz, uint newsz)
       return 0;
     }
     memset(mem, 0, PGSIZE);
-    if(mappages(pgdir, (char*)a, PGSIZE, V2P(mem), PTE_W|PTE_U) < 0){
+    // PTE_A keeps swapout() off the page until exec()
+    // has filled it in.
+    if(mappages(pgdir, (char*)a, PGSIZE, V2P(mem), PTE_W|PTE_U|PTE_A) < 0){
       cprintf("allocuvm out of memory (2)\n");
       deallocuvm(pgdir, newsz, oldsz);
       kfree(mem);
@@ -273,6 +295,9 @@ deallocuvm(pde_t *pgdir, uint oldsz, uint newsz)
       char *v = P2V(pa);
       kfree(v);
       *pte = 0;
+    } else if(*pte & PTE_SWAP){
+      swapfree(SWAPSLOT(*pte));
+      *pte = 0;
     }
   }
   return newsz;
@@ -288,7 +313,7 @@ freevm(pde_t *pgdir)
   if(pgdir == 0)
     panic("freevm: no pgdir");
   deallocuvm(pgdir, KERNBASE, 0);
-  for(i = 0; i < NPDENTRIES; i++){
+  for(i = 0; i < PDX(KERNBASE); i++){
     if(pgdir[i] & PTE_P){
       char * v = P2V(PTE_ADDR(pgdir[i]));
       kfree(v);
@@ -310,35 +335,756 @@ clearpteu(pde_t *pgdir, char *uva)
   *pte &= ~PTE_U;
 }
 
+// How copyrange() gives a child each page.
+#define COPY_EAGER  0   // a private copy, now
+#define COPY_COW    1   // shared until either side writes
+#define COPY_SHARE  2   // shared for good (MAP_SHARED)
+
+// Map the present pages of [start, end) in s into d as well.
+static int
+copyrange(pde_t *d, pde_t *s, uint start, uint end, int how)
+{
+  pte_t *pte, *npte;
+  uint pa, i, flags;
+  char *mem;
+
+  for(i = start; i < end; i += PGSIZE){
+    if((pte = walkpgdir(s, (void *) i, 0)) == 0)
+      continue;
+    if(*pte & PTE_SWAP){
+      // Both share the slot until one reads it back in.
+      if((npte = walkpgdir(d, (void *) i, 1)) == 0)
+        return -1;
+      *npte = *pte;
+      swapdup(SWAPSLOT(*pte));
+      continue;
+    }
+    if(!(*pte & PTE_P))
+      continue;  // not touched yet; see pagefault()
+    if(how == COPY_COW && (*pte & PTE_W))
+      *pte = (*pte & ~PTE_W) | PTE_COW;
+    pa = PTE_ADDR(*pte);
+    flags = PTE_FLAGS(*pte);
+    if(how == COPY_EAGER){
+      if(flags & PTE_COW)
+        flags = (flags | PTE_W) & ~PTE_COW;
+      if((mem = kalloc()) == 0)
+        return -1;
+      memmove(mem, (char*)P2V(pa), PGSIZE);
+      if(mappages(d, (void*)i, PGSIZE, V2P(mem), flags) < 0){
+        kfree(mem);
+        return -1;
+      }
+    } else {
+      if(mappages(d, (void*)i, PGSIZE, pa, flags) < 0)
+        return -1;
+      kdup(P2V(pa));
+    }
+  }
+  return 0;
+}
+
 // Given a parent process's page table, create a copy
-// of it for a child.
+// of it for a child.  If cow is set, share the pages
+// instead: writable ones become read-only PTE_COW pages
+// in both page tables, and the first write to one faults
+// into cowfault(), which gives the writer its own copy.
+// The caller must then flush the parent's TLB.
 pde_t*
-copyuvm(pde_t *pgdir, uint sz)
+copyuvm(pde_t *pgdir, uint sz, int cow)
 {
   pde_t *d;
+
+  if((d = setupkvm()) == 0)
+    return 0;
+  if(copyrange(d, pgdir, 0, sz, cow ? COPY_COW : COPY_EAGER) < 0){
+    freevm(d);
+    return 0;
+  }
+  return d;
+}
+
+// Resolve a write to the copy-on-write page at va in pgdir:
+// copy the page, or just make it writable again if no other
+// page table maps it.  Returns 0 if the write may be retried,
+// -1 if va is not a copy-on-write page or memory ran out.
+int
+cowfault(pde_t *pgdir, uint va)
+{
   pte_t *pte;
-  uint pa, i, flags;
+  char *mem, *old;
+
+  if(va >= KERNBASE || (pte = walkpgdir(pgdir, (void*)va, 0)) == 0)
+    return -1;
+  if((*pte & (PTE_P|PTE_U)) != (PTE_P|PTE_U))
+    return -1;
+  if(*pte & PTE_COW){
+    old = P2V(PTE_ADDR(*pte));
+    if(krefcnt(old) == 1)
+      *pte = (*pte | PTE_W) & ~PTE_COW;
+    else {
+      if((mem = kalloc()) == 0)
+        return -1;
+      memmove(mem, old, PGSIZE);
+      *pte = V2P(mem) | ((PTE_FLAGS(*pte) | PTE_W) & ~PTE_COW);
+      kfree(old);
+    }
+  } else if(!(*pte & PTE_W))
+    return -1;
+  invlpg((void*)va);
+  return 0;
+}
+
+// Pages after the faulting one that pagefault() reads
+// in at the same time from a file-backed range.
+#define FAULTAHEAD 3
+
+// Whether another CPU has vm in %cr3, and so may hold its
+// page table entries in its TLB.  There are no TLB
+// shootdowns.  switchuvm() sets c->vm under vm->lock, so
+// while the caller holds vm->lock no other CPU starts
+// using vm.
+static int
+vmbusy(struct vmspace *vm)
+{
+  struct cpu *c;
+
+  for(c = cpus; c < &cpus[ncpu]; c++)
+    if(c != mycpu() && c->vm == vm)
+      return 1;
+  return 0;
+}
+
+// Pages vmfree() frees at a time.
+#define NFREEBATCH 64
+
+// Unmap [start, end) of vm and free its pages and swap
+// slots.  A clone()d sibling running on another CPU may
+// still reach a page through its TLB, so a page is freed
+// only once each CPU that had vm loaded has been back to
+// its scheduler (see c->nsched), which loads another
+// %cr3.  Caller must not hold a spinlock, since this may
+// sleep.
+void
+vmfree(struct vmspace *vm, uint start, uint end)
+{
+  char *mem[NFREEBATCH];
+  uint nsched[NCPU], a;
+  int i, n, busy;
+  pte_t *pte;
+  struct cpu *c;
+
+  a = PGROUNDUP(start);
+  while(a < end){
+    acquire(&vm->lock);
+    for(n = 0; a < end && n < NFREEBATCH; a += PGSIZE){
+      pte = walkpgdir(vm->pgdir, (char*)a, 0);
+      if(!pte)
+        a = PGADDR(PDX(a) + 1, 0, 0) - PGSIZE;
+      else if(*pte & PTE_P){
+        mem[n++] = P2V(PTE_ADDR(*pte));
+        *pte = 0;
+      } else if(*pte & PTE_SWAP){
+        swapfree(SWAPSLOT(*pte));
+        *pte = 0;
+      }
+    }
+    busy = 0;
+    for(c = cpus; c < &cpus[ncpu]; c++){
+      nsched[c - cpus] = c->nsched;
+      if(c != mycpu() && c->vm == vm)
+        busy |= 1 << (c - cpus);
+    }
+    if(mycpu()->vm == vm)
+      lcr3(V2P(vm->pgdir));  // flush this CPU's TLB
+    release(&vm->lock);
+
+    while(busy){
+      for(c = cpus; c < &cpus[ncpu]; c++)
+        if(c->nsched != nsched[c - cpus] || c->vm != vm)
+          busy &= ~(1 << (c - cpus));
+      if(busy){
+        acquire(&tickslock);
+        sleep(&ticks, &tickslock);
+        release(&tickslock);
+      }
+    }
+    for(i = 0; i < n; i++)
+      kfree(mem[i]);
+  }
+}
+
+// Return the mapped range of vm holding va, or 0.
+static struct vma*
+vmalookup(struct vmspace *vm, uint va)
+{
+  struct vma *v;
+
+  for(v = vm->vma; v < &vm->vma[NVMA]; v++)
+    if(va >= v->start && va < v->end)
+      return v;
+  return 0;
+}
+
+// Whether va has neither a page nor a swap slot.
+static int
+unmapped(pde_t *pgdir, uint va)
+{
+  pte_t *pte;
+
+  pte = walkpgdir(pgdir, (void*)va, 0);
+  return pte == 0 || !(*pte & (PTE_P|PTE_SWAP));
+}
+
+// Record that [start, end) of vm is to be filled in on
+// demand: from ip at off if ip is set, else with zeros.
+// Caller holds vm->lock or is the only user of vm.
+struct vma*
+vmaadd(struct vmspace *vm, uint start, uint end, struct inode *ip,
+       uint off, uint filesz, int perm)
+{
+  struct vma *v;
+
+  for(v = vm->vma; v < &vm->vma[NVMA]; v++){
+    if(v->start == v->end){
+      v->start = start;
+      v->end = end;
+      v->ip = ip ? idup(ip) : 0;
+      v->off = off;
+      v->filesz = ip ? filesz : 0;
+      v->perm = perm;
+      v->shared = 0;
+      v->shm = 0;
+      return v;
+    }
+  }
+  return 0;
+}
+
+// Give dst the ranges of src, for fork().  The pages of
+// ranges above src->sz are not covered by copyuvm(), so
+// copy them here: MAP_SHARED ones stay shared, the rest
+// are copied eagerly or copy-on-write like copyuvm().
+// Caller holds src->lock.
+int
+vmacopy(struct vmspace *dst, struct vmspace *src, int cow)
+{
+  struct vma *v, *nv;
+  int how;
+
+  for(v = src->vma; v < &src->vma[NVMA]; v++){
+    if(v->start == v->end)
+      continue;
+    if((nv = vmaadd(dst, v->start, v->end, v->ip, v->off, v->filesz, v->perm)) == 0)
+      return -1;
+    nv->shared = v->shared;
+    if((nv->shm = v->shm) != 0)
+      shmdup(nv->shm);
+    if(v->start < src->sz)
+      continue;
+    how = v->shared ? COPY_SHARE : cow ? COPY_COW : COPY_EAGER;
+    if(copyrange(dst->pgdir, src->pgdir, v->start, v->end, how) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+// Map a zeroed page at a, a page of user memory that
+// has not been touched since sbrk() handed it out.
+static int
+lazyalloc(pde_t *pgdir, uint a, int perm)
+{
   char *mem;
 
-  if((d = setupkvm()) == 0)
+  if((mem = kalloc()) == 0)
+    return -1;
+  memset(mem, 0, PGSIZE);
+  if(mappages(pgdir, (char*)a, PGSIZE, V2P(mem), perm) < 0){
+    kfree(mem);
+    return -1;
+  }
+  return 0;
+}
+
+// Read n pages at a, which lie in range v of vm, in from
+// v's inode and map them.  Called without vm->lock, since
+// reading may sleep; v is the caller's copy of the range,
+// and its ip has been idup()ed in case of a racing munmap.
+static int
+pagein(struct vmspace *vm, struct vma *v, uint a, int n)
+{
+  char *mem[FAULTAHEAD+1];
+  struct vma *w;
+  uint off, cnt;
+  int i, nmem, r;
+
+  for(nmem = 0; nmem < n; nmem++){
+    if((mem[nmem] = kalloc()) == 0)
+      break;
+    memset(mem[nmem], 0, PGSIZE);
+  }
+
+  ilock(v->ip);
+  for(n = 0; n < nmem; n++){
+    off = a + n*PGSIZE - v->start;
+    if(off >= v->filesz)
+      continue;
+    cnt = v->filesz - off < PGSIZE ? v->filesz - off : PGSIZE;
+    if(readi(v->ip, mem[n], v->off + off, cnt) != cnt)
+      break;
+  }
+  iunlock(v->ip);
+
+  // Another thread may have faulted some of the pages
+  // in, or unmapped the range, meanwhile.
+  acquire(&vm->lock);
+  w = vmalookup(vm, a);
+  if(w == 0 || w->ip != v->ip || w->off + (a - w->start) != v->off + (a - v->start))
+    n = 0;
+  for(i = 0; i < nmem; i++){
+    if(i >= n || !unmapped(vm->pgdir, a + i*PGSIZE) ||
+       mappages(vm->pgdir, (char*)(a + i*PGSIZE), PGSIZE, V2P(mem[i]), v->perm) < 0)
+      kfree(mem[i]);
+  }
+  r = unmapped(vm->pgdir, a) ? -1 : 0;
+  release(&vm->lock);
+
+  begin_op();
+  iput(v->ip);
+  end_op();
+  return r;
+}
+
+// Read the page at a back in from swap.  entry is the
+// PTE_SWAP entry for a that the caller saw in vm's page
+// table; called without vm->lock, since reading sleeps.
+static int
+swapin(struct vmspace *vm, uint a, pte_t entry)
+{
+  pte_t *pte;
+  char *mem;
+
+  if((mem = kalloc()) == 0)
+    return -1;
+  swapread(SWAPSLOT(entry), mem);
+
+  // A sibling thread may have read it in meanwhile.
+  acquire(&vm->lock);
+  pte = walkpgdir(vm->pgdir, (void*)a, 0);
+  if(pte && *pte == entry){
+    *pte = V2P(mem) | (entry & (PTE_W|PTE_U)) | PTE_P | PTE_A | PTE_D;
+    swapfree(SWAPSLOT(entry));
+    mem = 0;
+  }
+  release(&vm->lock);
+  if(mem)
+    kfree(mem);
+  return 0;
+}
+
+// Handle a page fault at va in the current process, caused
+// by a write if write is set.  User memory that is not
+// mapped yet is read in from its file if it lies in a
+// file-backed range, or else is a zeroed page; pages that
+// were swapped out are read back in, and writes to
+// copy-on-write pages get a private copy.  Returns 0 if the
+// access can be retried, -1 if it was a real error.
+int
+pagefault(uint va, int write)
+{
+  struct vmspace *vm = myproc()->vm;
+  struct vma *v, copy;
+  pte_t *pte, entry;
+  uint a;
+  int r, n;
+
+  swapreserve(FAULTAHEAD + 2);
+  acquire(&vm->lock);
+  v = vmalookup(vm, va);
+  if(va >= vm->sz && v == 0){
+    release(&vm->lock);
+    return -1;
+  }
+  a = PGROUNDDOWN(va);
+  pte = walkpgdir(vm->pgdir, (void*)a, 0);
+  if(pte && (*pte & PTE_SWAP)){
+    entry = *pte;
+    release(&vm->lock);
+    return swapin(vm, a, entry);
+  }
+  if(!unmapped(vm->pgdir, va))
+    r = write ? cowfault(vm->pgdir, va) : -1;
+  else if(v == 0)
+    r = lazyalloc(vm->pgdir, a, PTE_W|PTE_U);
+  else if(v->shm)
+    r = -1;  // shmat() mapped every page; this one was munmap()ed
+  else if(a - v->start >= v->filesz)
+    r = lazyalloc(vm->pgdir, a, v->perm);
+  else {
+    // Read ahead the untouched pages that follow.
+    for(n = 1; n <= FAULTAHEAD && a + n*PGSIZE < v->end; n++)
+      if(!unmapped(vm->pgdir, a + n*PGSIZE))
+        break;
+    copy = *v;
+    idup(copy.ip);
+    release(&vm->lock);
+    return pagein(vm, &copy, a, n);
+  }
+  release(&vm->lock);
+  return r;
+}
+
+// Fault in now any pages of [va, va+n) in the current process
+// that are not in memory, and if the kernel is going to write
+// there, break copy-on-write shares and check that the pages
+// are writable.  System calls do this to their buffers, so
+// that touching them later cannot sleep in pagefault() while
+// holding a spinlock or another inode's lock, nor fault on a
+// read-only page, and so that running out of memory fails
+// the call rather than a fault taken in the kernel.
+int
+uvmprefault(uint va, uint n, int write)
+{
+  struct vmspace *vm = myproc()->vm;
+  struct vma *v;
+  pte_t *pte;
+  uint a;
+  int need;
+
+  for(a = PGROUNDDOWN(va); a < va + n; a += PGSIZE){
+    acquire(&vm->lock);
+    v = vmalookup(vm, a);
+    if(write && v && !(v->perm & PTE_W)){
+      release(&vm->lock);
+      return -1;
+    }
+    pte = walkpgdir(vm->pgdir, (void*)a, 0);
+    if(pte == 0 || !(*pte & PTE_P))
+      need = (pte && (*pte & PTE_SWAP)) || v != 0 || a < vm->sz;
+    else {
+      need = write && (*pte & PTE_COW);
+      *pte |= PTE_A;  // so that swapout() passes it over for now
+    }
+    release(&vm->lock);
+    if(need && pagefault(a, write) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+// Keep the current process's memory from being swapped out
+// until the end of the system call, so that the buffers it
+// has faulted in stay there: faulting one in again might
+// sleep on an inode lock or a log reservation that the
+// system call itself holds.
+void
+uvmpin(void)
+{
+  struct proc *p = myproc();
+
+  if(p->pinvm)
+    return;
+  acquire(&p->vm->lock);
+  p->vm->npin++;
+  release(&p->vm->lock);
+  p->pinvm = p->vm;
+}
+
+// Undo uvmpin(), if the current system call called it.
+void
+uvmunpin(void)
+{
+  struct proc *p = myproc();
+  struct vmspace *vm = p->pinvm;
+
+  if(vm == 0)
+    return;
+  acquire(&vm->lock);
+  vm->npin--;
+  release(&vm->lock);
+  p->pinvm = 0;
+}
+
+// Wait a tick for memory to be freed, for a fault at va
+// that the kernel took on user memory and that pagefault()
+// could not resolve.  Returns -1 if va is not the current
+// process's memory, or if the faulting code holds a spinlock
+// and so cannot sleep.
+int
+pagewait(uint va)
+{
+  int locked;
+
+  pushcli();
+  locked = mycpu()->ncli > 1;
+  popcli();
+  if(locked || uvmlimit(va) == 0)
+    return -1;
+  acquire(&tickslock);
+  sleep(&ticks, &tickslock);
+  release(&tickslock);
+  return 0;
+}
+
+// Return the end of the piece of user memory holding va
+// in the current process (the heap or a mapped range),
+// or 0 if va is not user memory.
+uint
+uvmlimit(uint va)
+{
+  struct vmspace *vm = myproc()->vm;
+  struct vma *v;
+  uint end;
+
+  acquire(&vm->lock);
+  if(va < vm->sz)
+    end = vm->sz;
+  else if((v = vmalookup(vm, va)) != 0)
+    end = v->end;
+  else
+    end = 0;
+  release(&vm->lock);
+  return end;
+}
+
+// Write the dirty pages of [start, end), part of the
+// MAP_SHARED range v of vm, back to v's file.  Like
+// filewrite(), split the writes into transactions small
+// enough for the log, reserving the same log space for
+// each, and never extend the file.
+static void
+writeback(struct vmspace *vm, struct vma *v, uint start, uint end)
+{
+  int max = ((log_opmax()-6) * NINDIRECT / (2*NINDIRECT+1)) * BSIZE;
+  int nb, nlog;
+  pte_t *pte;
+  uint a, off, i, n;
+  char *src;
+
+  for(a = start; a < end; a += PGSIZE){
+    acquire(&vm->lock);
+    pte = walkpgdir(vm->pgdir, (void*)a, 0);
+    if(pte == 0 || (*pte & (PTE_P|PTE_D)) != (PTE_P|PTE_D)){
+      release(&vm->lock);
+      continue;
+    }
+    // Clear PTE_D before writing the page, so that a store
+    // made meanwhile marks it again.  Another CPU with vm
+    // loaded may have the dirty bit cached in its TLB and
+    // not set it again, so leave it then.
+    if(!vmbusy(vm)){
+      *pte &= ~PTE_D;
+      if(mycpu()->vm == vm)
+        invlpg((void*)a);
+    }
+    src = P2V(PTE_ADDR(*pte));
+    release(&vm->lock);
+    off = v->off + (a - v->start);
+    for(i = 0; i < PGSIZE; i += n){
+      n = PGSIZE - i < max ? PGSIZE - i : max;
+      nb = (n + BSIZE-1) / BSIZE;
+      nlog = 2*nb + nb/NINDIRECT + 1+3+2;
+      begin_opn(nlog);
+      ilock(v->ip);
+      if(off + i < v->ip->size){
+        if(n > v->ip->size - (off + i))
+          n = v->ip->size - (off + i);
+        writei(v->ip, src + i, off + i, n);
+      } else
+        n = PGSIZE - i;
+      iunlock(v->ip);
+      end_opn(nlog);
+    }
+  }
+}
+
+// Return the lowest address above MMAPBASE with len free
+// bytes, or 0.  Caller holds vm->lock.
+static uint
+vmafind(struct vmspace *vm, uint len)
+{
+  struct vma *v;
+  uint a;
+
+  a = MMAPBASE;
+again:
+  for(v = vm->vma; v < &vm->vma[NVMA]; v++){
+    if(v->start != v->end && a < v->end && a + len > v->start){
+      a = v->end;
+      goto again;
+    }
+  }
+  if(a + len > KERNBASE || a + len < a)
+    return 0;
+  return a;
+}
+
+// Map the n pages of shared memory segment shm into the
+// current process, above the heap.  Each mapping takes a
+// reference to the page.  Returns the address, or 0.
+uint
+vmamappages(char **pages, int n, int perm, struct shmseg *shm)
+{
+  struct vmspace *vm = myproc()->vm;
+  struct vma *v;
+  uint a;
+  int i;
+
+  acquire(&vm->lock);
+  if((a = vmafind(vm, n*PGSIZE)) == 0 ||
+     (v = vmaadd(vm, a, a + n*PGSIZE, 0, 0, 0, perm)) == 0){
+    release(&vm->lock);
+    return 0;
+  }
+  v->shared = 1;
+  v->shm = shm;
+  for(i = 0; i < n; i++){
+    if(mappages(vm->pgdir, (char*)(a + i*PGSIZE), PGSIZE, V2P(pages[i]), perm) < 0){
+      deallocuvm(vm->pgdir, a + i*PGSIZE, a);
+      v->start = v->end = 0;
+      v->shm = 0;
+      release(&vm->lock);
+      return 0;
+    }
+    kdup(pages[i]);
+  }
+  release(&vm->lock);
+  return a;
+}
+
+// Map len bytes of ip from off (or zeros, if ip is 0) into
+// the current process, above the heap.  filesz bytes come
+// from the file.  MAP_SHARED ranges are filled in now, so
+// that fork() can share every page of them with the child.
+// Returns the address, or 0 on failure.
+uint
+vmamap(struct inode *ip, uint off, uint len, uint filesz, int perm, int shared)
+{
+  struct vmspace *vm = myproc()->vm;
+  struct vma *v;
+  uint a, i;
+
+  len = PGROUNDUP(len);
+  acquire(&vm->lock);
+  if((a = vmafind(vm, len)) == 0 ||
+     (v = vmaadd(vm, a, a + len, ip, off, filesz, perm)) == 0){
+    release(&vm->lock);
     return 0;
-  for(i = 0; i < sz; i += PGSIZE){
+  }
+  v->shared = shared;
+  release(&vm->lock);
+
+  if(shared){
+    for(i = 0; i < len; i += PGSIZE){
+      if(pagefault(a + i, 0) < 0){
+        vmaunmap(a, len);
+        return 0;
+      }
+    }
+  }
+  return a;
+}
+
+// Unmap [addr, addr+len) from the current process.  The
+// range must be the start or the end of one mapped range
+// (or all of it); MAP_SHARED file pages that were written
+// go back to the file.
+int
+vmaunmap(uint addr, uint len)
+{
+  struct vmspace *vm = myproc()->vm;
+  struct vma *v, copy;
+  uint end;
+  int whole;
+
+  if(addr % PGSIZE || len == 0)
+    return -1;
+  end = addr + PGROUNDUP(len);
+  acquire(&vm->lock);
+  if((v = vmalookup(vm, addr)) == 0 || v->start < MMAPBASE ||
+     (addr != v->start && end < v->end)){
+    release(&vm->lock);
+    return -1;
+  }
+  if(end > v->end)
+    end = v->end;
+  copy = *v;
+  whole = addr == v->start && end == v->end;
+  if(whole){
+    v->start = v->end = 0;
+    v->ip = 0;
+  } else if(addr == v->start){
+    v->off += end - v->start;
+    v->filesz = v->filesz > end - v->start ? v->filesz - (end - v->start) : 0;
+    v->start = end;
+  } else {
+    if(v->filesz > addr - v->start)
+      v->filesz = addr - v->start;
+    v->end = addr;
+  }
+  release(&vm->lock);
+
+  if(copy.ip && copy.shared)
+    writeback(vm, &copy, addr, end);
+  vmfree(vm, addr, end);
+  if(copy.ip && whole){
+    begin_op();
+    iput(copy.ip);
+    end_op();
+  }
+  if(copy.shm && whole)
+    shmput(copy.shm);
+  return 0;
+}
+
+// Unmap the whole range starting at addr, which shmat()
+// attached, from the current process.
+int
+vmadetach(uint addr)
+{
+  struct vmspace *vm = myproc()->vm;
+  struct vma *v;
+  uint len;
+
+  acquire(&vm->lock);
+  if((v = vmalookup(vm, addr)) == 0 || v->start != addr || v->shm == 0){
+    release(&vm->lock);
+    return -1;
+  }
+  len = v->end - v->start;
+  release(&vm->lock);
+  return vmaunmap(addr, len);
+}
+
+static int
+unsharerange(pde_t *pgdir, uint start, uint end)
+{
+  pte_t *pte;
+  uint i;
+
+  for(i = start; i < end; i += PGSIZE){
     if((pte = walkpgdir(pgdir, (void *) i, 0)) == 0)
-      panic("copyuvm: pte should exist");
-    if(!(*pte & PTE_P))
-      panic("copyuvm: page not present");
-    pa = PTE_ADDR(*pte);
-    flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
-      goto bad;
-    memmove(mem, (char*)P2V(pa), PGSIZE);
-    if(mappages(d, (void*)i, PGSIZE, V2P(mem), flags) < 0)
-      goto bad;
+      continue;
+    if((*pte & PTE_COW) && cowfault(pgdir, i) < 0)
+      return -1;
   }
-  return d;
+  return 0;
+}
+
+// Break every copy-on-write share in vm.  Called before an
+// address space gains a second thread, since without TLB
+// shootdowns a sibling could keep using a stale mapping of
+// a page that cowfault() has replaced.  Caller holds vm->lock.
+int
+unshareuvm(struct vmspace *vm)
+{
+  struct vma *v;
 
-bad:
-  freevm(d);
+  if(unsharerange(vm->pgdir, 0, vm->sz) < 0)
+    return -1;
+  for(v = vm->vma; v < &vm->vma[NVMA]; v++)
+    if(v->start >= vm->sz && unsharerange(vm->pgdir, v->start, v->end) < 0)
+      return -1;
   return 0;
 }
 
@@ -350,7 +1096,7 @@ uva2ka(pde_t *pgdir, char *uva)
   pte_t *pte;
 
   pte = walkpgdir(pgdir, uva, 0);
-  if((*pte & PTE_P) == 0)
+  if(pte == 0 || (*pte & PTE_P) == 0)
     return 0;
   if((*pte & PTE_U) == 0)
     return 0;
@@ -370,8 +1116,16 @@ copyout(pde_t *pgdir, uint va, void *p, uint len)
   while(len > 0){
     va0 = (uint)PGROUNDDOWN(va);
     pa0 = uva2ka(pgdir, (char*)va0);
-    if(pa0 == 0)
+    // Writes through the kernel mapping neither fault nor
+    // check PTE_W, so fault in untouched pages, break
+    // copy-on-write shares and refuse read-only pages by hand.
+    if((pa0 == 0 || !(*walkpgdir(pgdir, (char*)va0, 0) & PTE_W)) &&
+       (myproc() == 0 || pgdir != myproc()->vm->pgdir ||
+        pagefault(va0, 1) < 0 || (pa0 = uva2ka(pgdir, (char*)va0)) == 0))
       return -1;
+    // Mark the page used and dirty, as a user write would;
+    // see swapout().
+    *walkpgdir(pgdir, (char*)va0, 0) |= PTE_A|PTE_D;
     n = PGSIZE - (va - va0);
     if(n > len)
       n = len;
@@ -384,9 +1138,313 @@ copyout(pde_t *pgdir, uint va, void *p, uint len)
 }
 
 //PAGEBREAK!
-// Blank page.
+// Address spaces.
+//
+// A process and the threads it clone()s share one vmspace, so
+// that growing or shrinking memory from any of them is seen by
+// all, and the page table is freed exactly once, by whichever
+// of them is reaped last.
+
+struct {
+  struct spinlock lock;
+  struct vmspace vms[NPROC];
+} vmtable;
+
+// The clock hand of swapout().
+struct {
+  struct sleeplock lock;
+  int vm;               // index in vmtable.vms
+  uint va;              // next user address to look at there
+} hand;
+
+void
+vmsinit(void)
+{
+  struct vmspace *vm;
+
+  initlock(&vmtable.lock, "vmtable");
+  for(vm = vmtable.vms; vm < &vmtable.vms[NPROC]; vm++)
+    initlock(&vm->lock, "vmspace");
+  initsleeplock(&hand.lock, "swaphand");
+}
+
+// Allocate an address space for pgdir, which holds sz bytes
+// of user memory.  Takes over pgdir from the caller on success.
+struct vmspace*
+vmsalloc(pde_t *pgdir, uint sz)
+{
+  struct vmspace *vm;
+
+  acquire(&vmtable.lock);
+  for(vm = vmtable.vms; vm < &vmtable.vms[NPROC]; vm++){
+    if(vm->ref == 0){
+      vm->ref = 1;
+      vm->nlive = 1;
+      vm->npin = 0;
+      vm->pgdir = pgdir;
+      vm->sz = sz;
+      release(&vmtable.lock);
+      return vm;
+    }
+  }
+  release(&vmtable.lock);
+  return 0;
+}
+
+// Increment ref count for vm.
+struct vmspace*
+vmsdup(struct vmspace *vm)
+{
+  acquire(&vmtable.lock);
+  if(vm->ref < 1)
+    panic("vmsdup");
+  vm->ref++;
+  vm->nlive++;
+  release(&vmtable.lock);
+  return vm;
+}
+
+// Count the pages of vm's user memory that are resident
+// and that are out in swap.
+void
+vmsusage(struct vmspace *vm, int *nres, int *nswap)
+{
+  pte_t *pgtab;
+  uint i, j;
+
+  *nres = *nswap = 0;
+  acquire(&vm->lock);
+  for(i = 0; i < PDX(KERNBASE); i++){
+    if(!(vm->pgdir[i] & PTE_P))
+      continue;
+    pgtab = (pte_t*)P2V(PTE_ADDR(vm->pgdir[i]));
+    for(j = 0; j < NPTENTRIES; j++){
+      if((pgtab[j] & (PTE_P|PTE_U)) == (PTE_P|PTE_U))
+        (*nres)++;
+      else if(pgtab[j] & PTE_SWAP)
+        (*nswap)++;
+    }
+  }
+  release(&vm->lock);
+}
+
+// Count the pages holding page directories and page tables:
+// those of every address space and the kernel's shared ones.
+int
+vmsptpages(void)
+{
+  struct vmspace *vm;
+  uint i;
+  int n;
+
+  n = 1;
+  for(i = PDX(KERNBASE); i < NPDENTRIES; i++)
+    if((kpgdir[i] & (PTE_P|PTE_PS)) == PTE_P)
+      n++;
+  acquire(&vmtable.lock);
+  for(vm = vmtable.vms; vm < &vmtable.vms[NPROC]; vm++){
+    if(vm->ref == 0 || vm->pgdir == 0)
+      continue;
+    n++;
+    for(i = 0; i < PDX(KERNBASE); i++)
+      if(vm->pgdir[i] & PTE_P)
+        n++;
+  }
+  release(&vmtable.lock);
+  return n;
+}
+
+// Called when a process using vm exits or execs.  The
+// last one to leave writes back MAP_SHARED ranges and
+// drops the inodes behind vm's ranges.  That needs
+// transactions, so it cannot wait for vmsput(), which
+// runs with ptable.lock held.
+void
+vmsexit(struct vmspace *vm)
+{
+  struct vma *v;
+
+  acquire(&vmtable.lock);
+  if(--vm->nlive > 0){
+    release(&vmtable.lock);
+    return;
+  }
+  release(&vmtable.lock);
+
+  for(v = vm->vma; v < &vm->vma[NVMA]; v++){
+    if(v->start == v->end)
+      continue;
+    if(v->ip){
+      if(v->shared)
+        writeback(vm, v, v->start, v->end);
+      begin_op();
+      iput(v->ip);
+      end_op();
+    }
+    if(v->shm)
+      shmput(v->shm);
+    v->ip = 0;
+    v->shm = 0;
+    v->start = v->end = 0;
+  }
+}
+
+// Drop a reference to vm.  The last reference frees
+// the page table and all the user memory.
+void
+vmsput(struct vmspace *vm)
+{
+  pde_t *pgdir;
+
+  acquire(&vmtable.lock);
+  if(vm->ref < 1)
+    panic("vmsput");
+  if(--vm->ref > 0){
+    release(&vmtable.lock);
+    return;
+  }
+  pgdir = vm->pgdir;
+  vm->pgdir = 0;
+  vm->sz = 0;
+  release(&vmtable.lock);
+
+  freevm(pgdir);
+}
+
+//PAGEBREAK!
+// Swapping.
+//
+// When memory runs low, swapreserve() frees pages by pushing
+// user pages out to swap (see swap.c).  It picks them with
+// the clock algorithm: a hand sweeps over every address
+// space, clearing PTE_A on pages used since it last came by
+// and evicting the first page that has not been.  Evicted
+// pages come back in through pagefault().  Pages shared with
+// other page tables stay put, and clean pages of file-backed
+// ranges are just dropped, since pagefault() can read them
+// in again from the file.  So memory that fork() shares
+// copy-on-write cannot be swapped out until one side writes
+// to it or frees it, and a child that writes to many such
+// pages while memory is short may be killed for want of a
+// page to copy into.  Nor can the memory of a process that
+// is in a system call on one of its buffers (see uvmpin).
+
+// Evict a page of vm, looking from the hand onwards.
+// Returns 1 if a page was freed, 0 if the hand got to the
+// end of vm, -1 if swap is full.  Caller holds hand.lock.
+static int
+evict(struct vmspace *vm)
+{
+  struct vma *v;
+  pte_t *pte;
+  uint va, pa;
+  int slot;
+
+  acquire(&vm->lock);
+  // There are no TLB shootdowns, so leave alone address
+  // spaces in use on other CPUs, and those that a system
+  // call has pinned.
+  if(vmbusy(vm) || vm->npin > 0){
+    release(&vm->lock);
+    return 0;
+  }
+  for(va = hand.va; va < KERNBASE; va += PGSIZE){
+    if(!(vm->pgdir[PDX(va)] & PTE_P)){
+      va = PGADDR(PDX(va) + 1, 0, 0) - PGSIZE;
+      continue;
+    }
+    pte = walkpgdir(vm->pgdir, (void*)va, 0);
+    if((*pte & (PTE_P|PTE_U)) != (PTE_P|PTE_U))
+      continue;
+    if(*pte & PTE_A){
+      *pte &= ~PTE_A;  // second chance
+      if(mycpu()->vm == vm)
+        invlpg((void*)va);
+      continue;
+    }
+    pa = PTE_ADDR(*pte);
+    v = vmalookup(vm, va);
+    if((v && (v->shared || v->shm)) || krefcnt(P2V(pa)) > 1)
+      continue;
+    slot = -1;
+    if(v && v->ip && !(*pte & PTE_D))
+      *pte = 0;
+    else if((slot = swapalloc()) >= 0)
+      *pte = slot << PGSHIFT | PTE_SWAP | PTE_U |
+             ((*pte & (PTE_W|PTE_COW)) ? PTE_W : 0);
+    else {
+      release(&vm->lock);
+      return -1;
+    }
+    if(mycpu()->vm == vm)
+      invlpg((void*)va);
+    hand.va = va + PGSIZE;
+    release(&vm->lock);
+    if(slot >= 0)
+      swapwrite(slot, P2V(pa));
+    kfree(P2V(pa));
+    return 1;
+  }
+  release(&vm->lock);
+  return 0;
+}
+
+// Free a page of user memory.  Returns 0 on success,
+// -1 if there was nothing to evict or swap is full.
+static int
+swapout(void)
+{
+  struct vmspace *vm;
+  int i, r;
+
+  acquiresleep(&hand.lock);
+  // Twice round, since the first pass may only clear PTE_A.
+  for(i = 0; i <= 2*NPROC; i++){
+    acquire(&vmtable.lock);
+    vm = &vmtable.vms[hand.vm];
+    if(vm->nlive > 0)
+      vm->ref++;
+    else
+      vm = 0;
+    release(&vmtable.lock);
+    r = 0;
+    if(vm){
+      r = evict(vm);
+      vmsput(vm);
+    }
+    if(r != 0){
+      releasesleep(&hand.lock);
+      return r > 0 ? 0 : -1;
+    }
+    hand.vm = (hand.vm + 1) % NPROC;
+    hand.va = 0;
+  }
+  releasesleep(&hand.lock);
+  return -1;
+}
+
+// Make sure that at least n pages are free, swapping out
+// user pages if need be.  Does nothing if the caller holds
+// a spinlock, since swapping sleeps on the disk.
+void
+swapreserve(int n)
+{
+  uint nfree, nused, nsteal;
+  int locked;
+
+  pushcli();
+  locked = mycpu()->ncli > 1;
+  popcli();
+  if(locked || myproc() == 0)
+    return;
+  for(;;){
+    kmemstat(&nfree, &nused, &nsteal);
+    if(nfree >= n || swapout() < 0)
+      return;
+  }
+}
+
 //PAGEBREAK!
 // Blank page.
 //PAGEBREAK!
 // Blank page.
-
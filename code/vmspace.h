@@ -0,0 +1,27 @@
+// A range of user memory whose pages are filled in on
+// first touch (see pagefault()): read in from an inode,
+// or zeroed if there is none.  Bytes past filesz are zero,
+// like an ELF segment's bss.  exec() creates them for the
+// program's segments, mmap() and shmat() above MMAPBASE.
+struct vma {
+  uint start;           // page-aligned first address; start == end if unused
+  uint end;
+  struct inode *ip;     // holds a reference, or 0 for anonymous memory
+  uint off;             // file offset of start
+  uint filesz;          // bytes of the range backed by the file
+  int perm;             // PTE bits for its pages
+  int shared;           // MAP_SHARED: fork() shares the pages, writes reach the file
+  struct shmseg *shm;   // shared memory segment attached here, or 0
+};
+
+// User address space, shared by a process and the
+// threads it creates with clone().
+struct vmspace {
+  struct spinlock lock; // protects sz, vma and the user part of pgdir
+  int ref;              // number of procs using this address space
+  int nlive;            // of those, how many have not exited yet
+  int npin;             // threads in a system call using its memory (see uvmpin)
+  uint sz;              // Size of process memory (bytes)
+  pde_t* pgdir;         // Page table
+  struct vma vma[NVMA];
+};